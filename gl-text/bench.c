@@ -0,0 +1,371 @@
+#include "dfont.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+
+static double
+now() {
+	LARGE_INTEGER f, t;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1e9 / f.QuadPart;
+}
+#else
+#include <time.h>
+
+static double
+now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+#define ATLAS_SIZE 1024
+#define MAX_GLYPH (ATLAS_SIZE * ATLAS_SIZE / 144)
+#define QUERY_COUNT 0x10000
+#define ROUND_COUNT 7
+#define ROUND_LOOKUP 2000000
+
+struct glyph {
+	int c;
+	int font;
+};
+
+static uint32_t
+rnd(uint32_t *r) {
+	*r = *r * 1103515245 + 12345;
+	return *r >> 8;
+}
+
+// fill the atlas with glyphs of the given sizes, the codepoints are taken every `step` from U+4E00
+static int
+fill(struct dfont *df, struct glyph *g, const int *size, int nsize, int step) {
+	int i;
+	for (i=0;i<MAX_GLYPH;i++) {
+		int font = size[i % nsize];
+		int c = 0x4e00 + (i / nsize) * step;
+		if (dfont_insert(df, c, font, font, font, 0) == NULL)
+			break;
+		g[i].c = c;
+		g[i].font = font;
+	}
+	return i;
+}
+
+// best of ROUND_COUNT rounds, so a busy machine doesn't blur the numbers
+static void
+bench_lookup(struct dfont *df, const struct glyph *g, int n, int miss, const char *name) {
+	static struct glyph query[QUERY_COUNT];
+	int i, j;
+	uint32_t r = 1;
+	for (i=0;i<QUERY_COUNT;i++) {
+		query[i] = g[rnd(&r) % n];
+		query[i].font += miss;
+	}
+	int found = 0;
+	double best = 0;
+	for (j=0;j<ROUND_COUNT;j++) {
+		double t = now();
+		for (i=0;i<ROUND_LOOKUP;i++) {
+			const struct glyph *q = &query[i % QUERY_COUNT];
+			if (dfont_lookup(df, q->c, q->font, 0))
+				++found;
+		}
+		t = now() - t;
+		if (j == 0 || t < best)
+			best = t;
+	}
+	printf("%-12s %-4s %6d glyphs : %6.2f ns/lookup (%d found)\n", name, miss ? "miss" : "hit", n, best / ROUND_LOOKUP, found);
+}
+
+static void
+bench(const char *name, const int *size, int nsize, int step) {
+	static struct glyph g[MAX_GLYPH];
+	struct dfont *df = dfont_create(ATLAS_SIZE, ATLAS_SIZE);
+	int n = fill(df, g, size, nsize, step);
+	bench_lookup(df, g, n, 0, name);
+	bench_lookup(df, g, n, 1, name);
+	dfont_release(df);
+}
+
+// a frame draws FRAME_GLYPHS glyphs drawn from a zipf distribution over the charset,
+// each one is looked up and inserted when missing, then the frame is flushed
+#define FRAME_GLYPHS 400
+#define FRAME_COUNT 2000
+#define ZIPF_MAX 4096
+#define CLOCK_READS 100
+
+struct workload {
+	const char *name;
+	int atlas;
+	int first;	// the charset is count codepoints from first
+	int count;
+	const int *size;
+	int nsize;
+	int width;	// glyph width in percent of the size
+};
+
+struct sample {
+	int c;
+	int size;
+};
+
+static double zipf_cdf[ZIPF_MAX];
+
+static void
+zipf_init(int n) {
+	double sum = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		sum += 1.0 / (i + 1);
+		zipf_cdf[i] = sum;
+	}
+	for (i=0;i<n;i++)
+		zipf_cdf[i] /= sum;
+}
+
+static int
+zipf(uint32_t *r, int n) {
+	double x = (rnd(r) & 0xffffff) / (double)0x1000000;
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (zipf_cdf[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// the mean of n timed calls without the clock read each one paid, a call can't be faster than nothing
+static double
+mean_time(double total, long n, double timer) {
+	if (n == 0)
+		return 0;
+	double t = total / n - timer;
+	return t < 0 ? 0 : t;
+}
+
+static void
+run_workload(const struct workload *w) {
+	static struct sample stream[FRAME_GLYPHS * FRAME_COUNT];
+	int n = FRAME_GLYPHS * FRAME_COUNT;
+	int i;
+	uint32_t r = 1;
+	zipf_init(w->count);
+	for (i=0;i<n;i++) {
+		// the codepoints are shuffled so the frequent chars aren't all neighbours
+		int rank = zipf(&r, w->count);
+		stream[i].c = w->first + (rank * 2654435761u) % w->count;
+		stream[i].size = w->size[rnd(&r) % w->nsize];
+	}
+	struct dfont *df = dfont_create(w->atlas, w->atlas);
+	dfont_height_class(df, 4, 0);
+	// the cost of reading the clock, the least of a few reads : it is taken from the mean of the inserts
+	double timer = 0;
+	for (i=0;i<CLOCK_READS;i++) {
+		double t = now();
+		t = now() - t;
+		if (i == 0 || t < timer)
+			timer = t;
+	}
+	double t_lookup = 0, t_insert = 0, t_evict = 0;
+	long n_insert = 0, n_evict = 0;
+	struct dfont_stats st;
+	for (i=0;i<n;i+=FRAME_GLYPHS) {
+		int j;
+		double t = now();
+		for (j=0;j<FRAME_GLYPHS;j++) {
+			const struct sample *g = &stream[i+j];
+			dfont_lookup(df, g->c, g->size, 0);
+		}
+		t_lookup += now() - t;
+		// the misses are inserted one by one, so each insert is timed alone
+		for (j=0;j<FRAME_GLYPHS;j++) {
+			const struct sample *g = &stream[i+j];
+			if (dfont_lookup(df, g->c, g->size, 0))
+				continue;
+			dfont_stats(df, &st);
+			uint64_t evicted = st.evict_lru + st.evict_line;
+			t = now();
+			dfont_insert(df, g->c, g->size, g->size * w->width / 100, g->size, 0);
+			t = now() - t;
+			dfont_stats(df, &st);
+			if (st.evict_lru + st.evict_line != evicted) {
+				t_evict += t;
+				++n_evict;
+			} else {
+				t_insert += t;
+				++n_insert;
+			}
+		}
+		dfont_flush(df);
+	}
+	dfont_stats(df, &st);
+	printf("%-14s %6.2f ns/lookup %7.1f ns/insert %7.1f ns/evict | hit %5.1f%% fill %5.1f%% evict %5.2f/frame %4.1f%% of inserts, %llu failed\n",
+		w->name, t_lookup / n,
+		mean_time(t_insert, n_insert, timer),
+		mean_time(t_evict, n_evict, timer),
+		(n - n_insert - n_evict) * 100.0 / n,
+		st.pixels * 100.0 / st.total_pixels,
+		(double)(st.evict_lru + st.evict_line) / FRAME_COUNT,
+		(n_insert + n_evict) ? n_evict * 100.0 / (n_insert + n_evict) : 0.0,
+		(unsigned long long)st.failed);
+	dfont_release(df);
+}
+
+static void
+workloads() {
+	static const int ui[] = { 14, 16, 20 };
+	static const int text[] = { 16 };
+	static const int mixed[] = { 12, 16, 20, 24, 30, 36, 40, 48 };
+	static const int large[] = { 48 };
+	static const struct workload w[] = {
+		{ "ascii ui", 256, 32, 95, ui, 3, 60 },
+		{ "cjk 3500", 1024, 0x4e00, 3500, text, 1, 100 },
+		{ "cjk mixed", 1024, 0x4e00, 3500, mixed, 8, 100 },
+		{ "cjk thrash", 512, 0x4e00, 3500, large, 1, 100 },
+	};
+	int i;
+	for (i=0;i<(int)(sizeof(w)/sizeof(w[0]));i++)
+		run_workload(&w[i]);
+}
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <string.h>
+
+#define STRESS_ATLAS 512
+#define STRESS_CHARS 1000
+#define STRESS_SECONDS 2
+
+static const int stress_size[] = { 12, 16, 24 };
+
+struct reader {
+	pthread_t thread;
+	struct dfont *df;
+	int id;
+	long lookups;
+	long found;
+	long errors;
+};
+
+static int stress_stop;
+
+// the size of a glyph is known from its key, so a torn read shows up as a wrong rect
+static void *
+stress_reader(void *ud) {
+	struct reader *r = (struct reader *)ud;
+	uint32_t seed = r->id + 1;
+	int pages = dfont_pages(r->df);
+	while (!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED)) {
+		int i;
+		for (i=0;i<1024;i++) {
+			uint32_t k = rnd(&seed);
+			int font = stress_size[k % 3];
+			int c = 0x4e00 + (k >> 2) % STRESS_CHARS;
+			struct dfont_rect rect;
+			if (dfont_lookup_rect(r->df, c, font, 0, &rect)) {
+				++r->found;
+				if (rect.w != font || rect.h != font || rect.x < 0 || rect.y < 0
+					|| rect.x + rect.w > STRESS_ATLAS || rect.y + rect.h > STRESS_ATLAS
+					|| rect.page < 0 || rect.page >= pages) {
+					++r->errors;
+				}
+			}
+		}
+		r->lookups += i;
+	}
+	return NULL;
+}
+
+// one writer inserts the misses and compacts while the readers look up the same glyphs
+static void
+stress(int nreader) {
+	struct dfont *df = dfont_create_pages(STRESS_ATLAS, STRESS_ATLAS, 2);
+	static struct dfont_move moves[STRESS_ATLAS * STRESS_ATLAS / 144 * 2];
+	struct reader *r = (struct reader *)calloc(nreader, sizeof(*r));
+	int i;
+	uint32_t seed = 12345;
+	dfont_concurrent(df, 1);
+	// open both pages first, the readers check rect.page against them
+	while (dfont_pages(df) < 2) {
+		uint32_t k = rnd(&seed);
+		int font = stress_size[k % 3];
+		int c = 0x4e00 + (k >> 2) % STRESS_CHARS;
+		struct dfont_rect rect;
+		if (!dfont_lookup_rect(df, c, font, 0, &rect))
+			dfont_insert(df, c, font, font, font, 0);
+	}
+	stress_stop = 0;
+	for (i=0;i<nreader;i++) {
+		r[i].df = df;
+		r[i].id = i;
+		pthread_create(&r[i].thread, NULL, stress_reader, &r[i]);
+	}
+	long inserts = 0, failed = 0, compacts = 0;
+	double t = now();
+	double end = t + STRESS_SECONDS * 1e9;
+	while (now() < end) {
+		for (i=0;i<256;i++) {
+			uint32_t k = rnd(&seed);
+			int font = stress_size[k % 3];
+			int c = 0x4e00 + (k >> 2) % STRESS_CHARS;
+			struct dfont_rect rect;
+			if (!dfont_lookup_rect(df, c, font, 0, &rect)) {
+				if (dfont_insert(df, c, font, font, font, 0))
+					++inserts;
+				else
+					++failed;
+			}
+		}
+		dfont_flush(df);
+		if (rnd(&seed) % 64 == 0 && dfont_compact(df, rnd(&seed) % 2, moves, sizeof(moves)/sizeof(moves[0])) > 0)
+			++compacts;
+	}
+	__atomic_store_n(&stress_stop, 1, __ATOMIC_RELAXED);
+	long lookups = 0, found = 0, errors = 0;
+	for (i=0;i<nreader;i++) {
+		pthread_join(r[i].thread, NULL);
+		lookups += r[i].lookups;
+		found += r[i].found;
+		errors += r[i].errors;
+	}
+	t = now() - t;
+	printf("%d readers : %8.2f M lookups/s (%.2f per thread, %.1f%% found), %ld inserts %ld failed %ld compacts, %ld bad rects\n",
+		nreader, lookups * 1e3 / t, lookups * 1e3 / t / nreader, lookups ? found * 100.0 / lookups : 0.0,
+		inserts, failed, compacts, errors);
+	free(r);
+	dfont_release(df);
+	if (errors)
+		exit(1);
+}
+#endif
+
+int
+main(int argc, char *argv[]) {
+	static const int small[] = { 12 };
+	static const int medium[] = { 24 };
+	static const int large[] = { 48 };
+	static const int mixed[] = { 30, 40, 50, 60 };
+#if !defined(_WIN32)
+	if (argc > 1 && strcmp(argv[1], "threads") == 0) {
+		int n = argc > 2 ? atoi(argv[2]) : 4;
+		int i;
+		for (i=1;i<=n;i*=2)
+			stress(i);
+		return 0;
+	}
+#endif
+	bench("cjk 12px", small, 1, 1);
+	bench("cjk 24px", medium, 1, 1);
+	bench("cjk 48px", large, 1, 1);
+	bench("cjk mixed", mixed, 4, 7);
+	workloads();
+	return 0;
+}
@@ -1,382 +1,2251 @@
 #include "dfont.h"
 #include "list.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
 
-#define HASH_SIZE 4096
+#if defined(_WIN32)
+#include <windows.h>
+#define cpu_yield() SwitchToThread()
+#define process_id() ((int)GetCurrentProcessId())
+#else
+#include <sched.h>
+#include <unistd.h>
+#define cpu_yield() sched_yield()
+#define process_id() ((int)getpid())
+#endif
+
 #define TINY_FONT 12
+#define HASH_MIN 64
+#define GROUP_SIZE 8
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define TOUCH_SIZE 256
+#define REQUEST_SIZE 256
+#define LRU_CLASSES (DFONT_PIN + 1)
+#define PROMOTE_FRAMES 16
+#define SHARED_MAGIC 0x31484644	// "DFH1"
 
-struct hash_rect {
-	struct hash_rect * next_hash;
-	struct list_head next_char;
-	struct list_head time;
-	int version;
-	int c;
-	int line;
-	int font;
-	int edge;
-	struct dfont_rect rect;
+// the chars are parallel arrays indexed by node, and the lists link them by index.
+// a list head is a link after the nodes : line i is at max_char+i in char_link,
+// and line height h, priority p at max_char+h*LRU_CLASSES+p in time_link, the freelist follows them.
+struct node_link {
+	uint32_t next;
+	uint32_t prev;
 };
 
 struct font_line {
+	int page;
 	int start_line;
 	int height;
 	int space;
-	struct list_head head;
+	int free;
+	int dirty_x0;	// the columns written to the mirror since the last dfont_flush_uploads
+	int dirty_x1;
+	struct list_head klass;	// lines of the same height, or the free lines
+	struct list_head order;	// all lines of the page, sorted by start_line
+};
+
+struct font_page {
+	struct list_head order;
+	struct list_head free_line;
+};
+
+// open addressing, probed by groups of GROUP_SIZE control bytes.
+// a control byte is CTRL_EMPTY, CTRL_DELETED or the 7 high bits of the hash.
+struct hash_table {
+	int cap;
+	int shift;
+	int max_cap;
+	int used;
+	int deleted;
+	int serial;	// bumped on rehash, slots found before are stale
+	uint64_t *key;
+	uint8_t *ctrl;
+	uint32_t *index;
+};
+
+// the rings are written by readers which reserve slot i first : a slot is published with seq = i + 1,
+// so a slot reserved and not written yet, or left from an older lap, is told apart
+struct request_slot {
+	unsigned seq;	// 0 while it is written
+	uint64_t key;
 };
 
 struct dfont {
 	int width;
 	int height;
+	int page;
+	int max_page;
+	int max_char;
 	int max_line;
 	int version;
-	struct list_head time;
-	struct hash_rect *freelist;
+	int concurrent;
+	int lock;
+	unsigned seq;	// odd while a writer changes the table or the rects
+	unsigned touch_head;
+	unsigned touch_tail;
+	uint64_t touch[TOUCH_SIZE];	// nodes found by dfont_lookup_rect, moved in the time list by the next writer. see touch_slot
+	unsigned request_head;
+	unsigned request_tail;
+	struct request_slot request[REQUEST_SIZE];	// keys asked by dfont_request, taken by dfont_requests
+	uint32_t shared_magic;	// SHARED_MAGIC once dfont_shared_init is done
+	size_t shared_size;
+	void *base;	// the address of the block in the process that made it, the pointers below are valid there
+	int owner;	// the id of that process, a client may map the block at the same address
+	struct dfont_stats stat;	// only the counters are kept up to date, dfont_stats fills the rest
+	struct list_head idle_line;
+	struct list_head *klass;
+	int *height_class;	// the line height for each glyph height
+	struct font_page *pages;
+	uint8_t *mirror;	// A8 pixels of every page, see dfont_mirror
+	FILE *trace;
+	uint64_t *node_key;
+	struct dfont_rect *node_rect;
+	int *node_version;
+	int *node_line;	// -1 in the freelist
+	uint8_t *node_ready;	// the pixels are in the mirror, see dfont_read
+	uint8_t *node_priority;	// see dfont_priority
+	uint8_t *node_frames;	// the frames it was used on, up to 255
+	struct node_link *char_link;	// the chars of a line, sorted by x
+	struct node_link *time_link;	// the chars of each line height and priority, the least recently used first
 	struct font_line *line;
-	struct hash_rect *hash[HASH_SIZE];
+	struct hash_table hash;
 };
 
+static inline void
+link_init(struct node_link *l, uint32_t head) {
+	l[head].next = l[head].prev = head;
+}
+
+static inline int
+link_empty(struct node_link *l, uint32_t head) {
+	return l[head].next == head;
+}
+
+static inline void
+link_insert(struct node_link *l, uint32_t n, uint32_t prev, uint32_t next) {
+	l[n].prev = prev;
+	l[n].next = next;
+	l[prev].next = n;
+	l[next].prev = n;
+}
+
+static inline void
+link_add(struct node_link *l, uint32_t n, uint32_t head) {
+	link_insert(l, n, head, l[head].next);
+}
+
+static inline void
+link_add_tail(struct node_link *l, uint32_t n, uint32_t head) {
+	link_insert(l, n, l[head].prev, head);
+}
+
+static inline void
+link_del(struct node_link *l, uint32_t n) {
+	l[l[n].prev].next = l[n].next;
+	l[l[n].next].prev = l[n].prev;
+}
+
+static inline void
+link_move(struct node_link *l, uint32_t n, uint32_t head) {
+	link_del(l, n);
+	link_add(l, n, head);
+}
+
+static inline void
+link_move_tail(struct node_link *l, uint32_t n, uint32_t head) {
+	link_del(l, n);
+	link_add_tail(l, n, head);
+}
+
+#define link_for_each(i, l, head) for (i = (l)[head].next; i != (head); i = (l)[i].next)
+
+static inline uint32_t
+line_head(struct dfont *df, struct font_line *line) {
+	return df->max_char + (line - df->line);
+}
+
+static inline uint32_t
+lru_head(struct dfont *df, int height, int priority) {
+	return df->max_char + height * LRU_CLASSES + priority;
+}
+
+static inline uint32_t
+free_head(struct dfont *df) {
+	return df->max_char + (df->height + 1) * LRU_CLASSES;
+}
+
+static inline uint64_t
+pack_key(int c, int font, int edge) {
+	assert(font >= 0 && font < 0x1000000);
+	assert(edge >= 0 && edge < 0x100);
+	return (uint64_t)(uint32_t)c << 32 | (uint64_t)font << 8 | (uint64_t)edge;
+}
+
+// the parts of a key, any 64 bit key splits into a (c, font, edge) that packs back to it
+static inline int
+key_c(uint64_t key) {
+	return (int)(key >> 32);
+}
+
+static inline int
+key_font(uint64_t key) {
+	return (int)(key >> 8 & 0xffffff);
+}
+
+static inline int
+key_edge(uint64_t key) {
+	return (int)(key & 0xff);
+}
+
+static inline uint64_t
+hash(uint64_t key) {
+	return key * 0x9e3779b97f4a7c15ULL;
+}
+
+#define LSB 0x0101010101010101ULL
+#define MSB 0x8080808080808080ULL
+
+// the masks below keep the high bit of each matching byte, little endian.
+
+static inline uint64_t
+group_load(const uint8_t *ctrl) {
+	uint64_t g;
+	memcpy(&g, ctrl, sizeof(g));
+	return g;
+}
+
+static inline uint64_t
+group_match(uint64_t g, uint8_t tag) {
+	// may report a false match above a real one, the key compare filters it
+	uint64_t x = g ^ (LSB * tag);
+	return (x - LSB) & ~x & MSB;
+}
+
+static inline uint64_t
+group_empty(uint64_t g) {
+	return g & (~g << 6) & MSB;
+}
+
+static inline uint64_t
+group_free(uint64_t g) {
+	return g & ~(g << 7) & MSB;
+}
+
+static inline int
+group_first(uint64_t m) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(m) >> 3;
+#else
+	int i = 0;
+	while ((m & 0x80) == 0) {
+		m >>= 8;
+		++i;
+	}
+	return i;
+#endif
+}
+
+static int
+group_bits(int cap) {
+	int bits = 0;
+	while ((GROUP_SIZE << bits) < cap)
+		++bits;
+	return bits;
+}
+
+static int
+hash_max_cap(int max_char) {
+	int cap = HASH_MIN;
+	while (cap - cap / 2 <= max_char)
+		cap *= 2;
+	return cap;
+}
+
+static inline int
+hash_find(struct hash_table *t, uint64_t key) {
+	uint64_t h = hash(key);
+	uint8_t tag = (h >> (t->shift - 7)) & 0x7f;
+	int mask = t->cap / GROUP_SIZE - 1;
+	int g = (int)(h >> t->shift) & mask;
+	int step = 0;
+	for (;;) {
+		int base = g * GROUP_SIZE;
+		uint64_t grp = group_load(t->ctrl + base);
+		uint64_t m = group_match(grp, tag);
+		while (m) {
+			int slot = base + group_first(m);
+			if (t->key[slot] == key)
+				return slot;
+			m &= m - 1;
+		}
+		// every group is seen after mask+1 steps, dfont_lookup_rect may read a table in the middle of a rehash
+		if (group_empty(grp) || step == mask)
+			return -1;
+		g = (g + ++step) & mask;
+	}
+}
+
+static int
+hash_probe(struct hash_table *t, uint64_t key, int *hint) {
+	// like hash_find, and remember the first free slot on the way for the insert
+	uint64_t h = hash(key);
+	uint8_t tag = (h >> (t->shift - 7)) & 0x7f;
+	int mask = t->cap / GROUP_SIZE - 1;
+	int g = (int)(h >> t->shift);
+	int step = 0;
+	*hint = -1;
+	for (;;) {
+		int base = g * GROUP_SIZE;
+		uint64_t grp = group_load(t->ctrl + base);
+		uint64_t m = group_match(grp, tag);
+		while (m) {
+			int slot = base + group_first(m);
+			if (t->key[slot] == key)
+				return slot;
+			m &= m - 1;
+		}
+		if (*hint < 0) {
+			m = group_free(grp);
+			if (m)
+				*hint = base + group_first(m);
+		}
+		if (group_empty(grp))
+			return -1;
+		g = (g + ++step) & mask;
+	}
+}
+
+static void
+hash_place(struct hash_table *t, int slot, uint64_t key, uint32_t index) {
+	if (t->ctrl[slot] == CTRL_DELETED)
+		--t->deleted;
+	t->ctrl[slot] = (hash(key) >> (t->shift - 7)) & 0x7f;
+	t->key[slot] = key;
+	t->index[slot] = index;
+	++t->used;
+}
+
+static void
+hash_set(struct hash_table *t, uint64_t key, uint32_t index) {
+	uint64_t h = hash(key);
+	int mask = t->cap / GROUP_SIZE - 1;
+	int g = (int)(h >> t->shift);
+	int step = 0;
+	for (;;) {
+		int base = g * GROUP_SIZE;
+		uint64_t m = group_free(group_load(t->ctrl + base));
+		if (m) {
+			hash_place(t, base + group_first(m), key, index);
+			return;
+		}
+		g = (g + ++step) & mask;
+	}
+}
+
+static void
+hash_erase(struct hash_table *t, int slot) {
+	// a group that still has an empty byte never made a probe go past it
+	int base = slot & ~(GROUP_SIZE - 1);
+	if (group_empty(group_load(t->ctrl + base))) {
+		t->ctrl[slot] = CTRL_EMPTY;
+	} else {
+		t->ctrl[slot] = CTRL_DELETED;
+		++t->deleted;
+	}
+	--t->used;
+}
+
+static void
+hash_rehash(struct dfont *df, int cap) {
+	struct hash_table *t = &df->hash;
+	t->cap = cap;
+	t->shift = 64 - group_bits(cap);
+	++t->serial;
+	t->used = 0;
+	t->deleted = 0;
+	memset(t->ctrl, CTRL_EMPTY, cap);
+	uint32_t head;
+	for (head=lru_head(df, 0, 0);head<free_head(df);head++) {
+		uint32_t n;
+		link_for_each(n, df->time_link, head) {
+			hash_set(t, df->node_key[n], n);
+		}
+	}
+}
+
+static void
+hash_insert(struct dfont *df, uint64_t key, uint32_t index, int slot) {
+	struct hash_table *t = &df->hash;
+	if (t->used + t->deleted >= t->cap - t->cap / 2) {
+		// grow unless the deleted marks take most of the room, then only wipe them
+		int cap = t->cap;
+		if (t->used >= cap / 4 + cap / 8 && cap < t->max_cap)
+			cap *= 2;
+		hash_rehash(df, cap);
+		hash_set(t, key, index);
+	} else {
+		hash_place(t, slot, key, index);
+	}
+}
+
 static void
 init_hash(struct dfont *df, int max) {
 	int i;
+	uint32_t head;
+	for (head=lru_head(df, 0, 0);head<=free_head(df);head++) {
+		link_init(df->time_link, head);
+	}
 	for (i=0;i<max;i++) {
-		struct hash_rect * hr = &df->freelist[i];
-		hr->next_hash = &df->freelist[i+1];
+		df->node_line[i] = -1;
+		link_add_tail(df->time_link, i, free_head(df));
 	}
-	df->freelist[max-1].next_hash = NULL;
+	df->hash.cap = HASH_MIN;
+	df->hash.shift = 64 - group_bits(HASH_MIN);
+	df->hash.used = 0;
+	df->hash.deleted = 0;
+	df->hash.serial = 0;
+	memset(df->hash.ctrl, CTRL_EMPTY, df->hash.cap);
+}
 
-	memset(df->hash, 0, sizeof(df->hash));
+// the lines and the chars of max_page pages full of tiny*tiny glyphs
+static size_t
+data_size(int width, int height, int max_page, int tiny) {
+	int max_line = (height / tiny + 1) * max_page;
+	int max_char = (height / tiny) * width / tiny * max_page;
+	size_t ssize = max_char * (sizeof(uint64_t) + sizeof(struct dfont_rect) + 2 * sizeof(int));
+	size_t nsize = (2 * max_char + max_line + (height + 1) * LRU_CLASSES + 1) * sizeof(struct node_link);
+	size_t lsize = max_line * sizeof(struct font_line);
+	size_t ksize = (height + 1) * sizeof(struct list_head);
+	size_t psize = max_page * sizeof(struct font_page);
+	size_t csize = (height + 1) * sizeof(int) + 3 * max_char;
+	size_t hsize = hash_max_cap(max_char) * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t));
+	return sizeof(struct dfont) + hsize + ssize + nsize + lsize + ksize + psize + csize;
 }
 
-#ifdef FONT_EDGE_HASH
-static inline int
-hash(int c, int font, int edge) {
-	if (edge != 0) {
-		edge = 1;
-	}
-	return ((unsigned)(((c ^ (font * 97))<<1)|edge)) % HASH_SIZE;
+size_t
+dfont_data_size(int width, int height, int max_page) {
+	return data_size(width, height, max_page, TINY_FONT);
 }
-#else
-static inline int
-hash(int c, int font, int edge) {
-	return ((unsigned)(c ^ (font * 97))) % HASH_SIZE;
+
+static void
+init_line(struct dfont *df, int max_line) {
+	int i;
+	INIT_LIST_HEAD(&df->idle_line);
+	for (i=0;i<=df->height;i++) {
+		INIT_LIST_HEAD(&df->klass[i]);
+	}
+	for (i=0;i<max_line;i++) {
+		list_add_tail(&df->line[i].order, &df->idle_line);
+	}
 }
-#endif
 
-size_t
-dfont_data_size(int width, int height) {
-	int max_line = height / TINY_FONT;
-	int max_char = max_line * width / TINY_FONT;
-	size_t ssize = max_char * sizeof(struct hash_rect);
-	size_t lsize = max_line * sizeof(struct font_line);
-	return sizeof(struct dfont) + ssize + lsize;
+static struct font_line *
+open_page(struct dfont *df) {
+	if (df->page >= df->max_page)
+		return NULL;
+	struct font_page *p = &df->pages[df->page];
+	INIT_LIST_HEAD(&p->order);
+	INIT_LIST_HEAD(&p->free_line);
+	// the whole page starts as one free line, there are line records enough for every page
+	struct font_line * line = list_entry(df->idle_line.next, struct font_line, order);
+	list_del(&line->order);
+	line->page = df->page++;
+	line->start_line = 0;
+	line->height = df->height;
+	line->space = df->width;
+	line->free = 1;
+	link_init(df->char_link, line_head(df, line));
+	list_add_tail(&line->order, &p->order);
+	list_add_tail(&line->klass, &p->free_line);
+	return line;
 }
 
-void
-dfont_init(void* d, int width, int height) {
-	int max_line = height / TINY_FONT;
-	int max_char = max_line * width / TINY_FONT;
-	size_t ssize = max_char * sizeof(struct hash_rect);
+static void
+init(void* d, int width, int height, int max_page, int tiny) {
+	int max_line = (height / tiny + 1) * max_page;
+	int max_char = (height / tiny) * width / tiny * max_page;
+	size_t lsize = max_line * sizeof(struct font_line);
+	size_t ksize = (height + 1) * sizeof(struct list_head);
+	int hcap = hash_max_cap(max_char);
 	
 	struct dfont *df = (struct dfont*)d;
 	
 	df->width = width;
 	df->height = height;
-	df->max_line = 0;
+	df->page = 0;
+	df->max_page = max_page;
+	df->max_char = max_char;
+	df->max_line = max_line;
 	df->version = 0;
-	INIT_LIST_HEAD(&df->time);
-	df->freelist = (struct hash_rect *)(df+1);
-	df->line = (struct font_line *)((intptr_t)df->freelist + ssize);
+	df->concurrent = 0;
+	df->lock = 0;
+	df->seq = 0;
+	df->touch_head = 0;
+	df->touch_tail = 0;
+	memset(df->touch, 0, sizeof(df->touch));
+	memset(&df->stat, 0, sizeof(df->stat));
+	df->hash.max_cap = hcap;
+	df->hash.key = (uint64_t *)(df+1);
+	df->hash.index = (uint32_t *)(df->hash.key + hcap);
+	df->hash.ctrl = (uint8_t *)(df->hash.index + hcap);
+	// the 8 byte aligned arrays first
+	df->node_key = (uint64_t *)(df->hash.ctrl + hcap);
+	df->line = (struct font_line *)(df->node_key + max_char);
+	df->klass = (struct list_head *)((intptr_t)df->line + lsize);
+	df->pages = (struct font_page *)((intptr_t)df->klass + ksize);
+	df->node_rect = (struct dfont_rect *)(df->pages + max_page);
+	df->node_version = (int *)(df->node_rect + max_char);
+	df->node_line = df->node_version + max_char;
+	df->char_link = (struct node_link *)(df->node_line + max_char);
+	df->time_link = df->char_link + max_char + max_line;
+	df->height_class = (int *)(df->time_link + max_char + (height + 1) * LRU_CLASSES + 1);
+	df->node_ready = (uint8_t *)(df->height_class + height + 1);
+	df->node_priority = df->node_ready + max_char;
+	df->node_frames = df->node_priority + max_char;
+	df->mirror = NULL;
+	df->trace = NULL;
+	df->request_head = 0;
+	df->request_tail = 0;
+	memset(df->request, 0, sizeof(df->request));
+	df->shared_magic = 0;
+	df->shared_size = 0;
+	df->base = df;
+	df->owner = process_id();
+	dfont_height_class(df, 1, 0);
 	init_hash(df, max_char);
+	init_line(df, max_line);
+	open_page(df);
+}
+
+void
+dfont_init(void* d, int width, int height, int max_page) {
+	init(d, width, height, max_page, TINY_FONT);
+}
+
+// drop every glyph and page, the version and the hash serial go on so the old rects and misses stay stale
+static void
+reset(struct dfont *df) {
+	int serial = df->hash.serial;
+	df->page = 0;
+	init_hash(df, df->max_char);
+	df->hash.serial = serial + 1;
+	init_line(df, df->max_line);
+	open_page(df);
 }
 
 struct dfont *
-dfont_create(int width, int height) {
-	size_t size = dfont_data_size(width, height);
+dfont_create_min(int width, int height, int max_page, int min_size) {
+	if (max_page < 1)
+		max_page = 1;
+	if (min_size < 1)
+		min_size = 1;
+	size_t size = data_size(width, height, max_page, min_size);
 	void *df = malloc(size);
-	dfont_init(df, width, height);
+	if (df == NULL)
+		return NULL;
+	init(df, width, height, max_page, min_size);
 	
 	return (struct dfont*)df;
 }
 
+struct dfont *
+dfont_create_pages(int width, int height, int max_page) {
+	return dfont_create_min(width, height, max_page, TINY_FONT);
+}
+
+struct dfont *
+dfont_create(int width, int height) {
+	return dfont_create_pages(width, height, 1);
+}
+
+int
+dfont_pages(struct dfont *df) {
+	return df->page;
+}
+
 void
 dfont_release(struct dfont *df) {
 	free(df);
 }
 
-void 
-dfont_flush(struct dfont *df) {
-	++df->version;
+// trace : the header, then an op byte and its arguments as zigzag varints for each call
+static void
+trace_record(struct dfont *df, int op, int n, const int *args) {
+	uint8_t buf[1 + DFONT_TRACE_ARGS * 5];
+	int sz = 0;
+	int i;
+	buf[sz++] = op;
+	for (i=0;i<n;i++) {
+		uint32_t v = ((uint32_t)args[i] << 1) ^ (uint32_t)(args[i] >> 31);
+		while (v >= 0x80) {
+			buf[sz++] = (v & 0x7f) | 0x80;
+			v >>= 7;
+		}
+		buf[sz++] = v;
+	}
+	// one write for each record, the readers of a concurrent dfont trace without the lock
+	fwrite(buf, 1, sz, df->trace);
 }
 
+#define TRACE(df, op, ...) do { \
+	if (df->trace) { \
+		int args_[] = { __VA_ARGS__ }; \
+		trace_record(df, op, sizeof(args_) / sizeof(int), args_); \
+	} \
+} while (0)
+
 void
-dfont_remove(struct dfont *df, int c, int font, int edge) {
-	int h = hash(c, font, edge);
-	struct hash_rect *hr = df->hash[h];
-	while (hr) {
-		if (hr->c == c && hr->font == font && hr->edge == edge) {
-			list_move(&hr->time, &df->time);
-			hr->version = df->version-1;
-			return;
-		}
-		hr = hr->next_hash;
+dfont_trace(struct dfont *df, FILE *f) {
+	df->trace = f;
+	if (f) {
+		int32_t header[4] = { DFONT_TRACE_MAGIC, df->width, df->height, df->max_page };
+		fwrite(header, sizeof(header), 1, f);
 	}
 }
 
-const struct dfont_rect * 
-dfont_lookup(struct dfont *df, int c, int font, int edge) {
-	int h = hash(c, font, edge);
-	struct hash_rect *hr = df->hash[h];
-	while (hr) {
-		if (hr->c == c && hr->font == font && hr->edge == edge) {
-			list_move_tail(&hr->time, &df->time);
-			hr->version = df->version;
-			return &(hr->rect);
+void
+dfont_height_class(struct dfont *df, int step, int growth) {
+	int h = 0;
+	int class_height = 0;
+	TRACE(df, DFONT_TRACE_HEIGHT_CLASS, step, growth);
+	if (step < 1)
+		step = 1;
+	while (h <= df->height) {
+		if (h > class_height) {
+			// the next bucket is at least growth percent taller, rounded up to the step
+			int next = class_height + class_height * growth / 100;
+			if (next < h)
+				next = h;
+			class_height = (next + step - 1) / step * step;
+			if (class_height > df->height)
+				class_height = df->height;
 		}
-		hr = hr->next_hash;
+		df->height_class[h++] = class_height;
 	}
-	return NULL;
 }
 
-static struct font_line *
-new_line(struct dfont *df, int height) {
-	int start_line = 0;
-	if (df->max_line > 0) {
-		struct font_line * lastline = &df->line[df->max_line-1];
-		start_line = lastline->start_line + lastline->height;
-	}
-	if (start_line + height > df->height)
-		return NULL;
-	int max = df->height / TINY_FONT;
-	if (df->max_line >= max)
-		return NULL;
-	struct font_line * line = &df->line[df->max_line++];
-	line->start_line = start_line;
-	line->height = height;
-	line->space = df->width;
-	INIT_LIST_HEAD(&line->head);
-	return line;
+void
+dfont_concurrent(struct dfont *df, int enable) {
+	df->concurrent = enable;
 }
 
-static struct font_line *
-find_line(struct dfont *df, int width, int height) {
-	int i;
-	for (i=0;i<df->max_line;i++) {
-		struct font_line * line = &df->line[i];
-		if (height == line->height && width <= line->space) {
-			return line;
-		}
-	}
-	return new_line(df, height);
+static inline uint32_t
+lru_of(struct dfont *df, uint32_t n) {
+	return lru_head(df, df->line[df->node_line[n]].height, df->node_priority[n]);
 }
 
-static struct hash_rect *
-new_node(struct dfont *df) {
-	if (df->freelist == NULL)
-		return NULL;
-	struct hash_rect *ret = df->freelist;
-	df->freelist = ret->next_hash;
-	return ret;
+// a char of priority p can be evicted once it is unused for 2^p versions
+static inline int
+expired(struct dfont *df, uint32_t n) {
+	int p = df->node_priority[n];
+	return p < DFONT_PIN && (unsigned)(df->version - df->node_version[n]) >= 1u << p;
 }
 
-static struct hash_rect *
-find_space(struct dfont *df, struct font_line *line, int width) {
-	int start_pos = 0;
-	struct hash_rect * hr;
-	int max_space = 0;
-	list_for_each_entry(hr, struct hash_rect, &line->head, next_char) {
-		int space = hr->rect.x - start_pos;
-		if (space >= width) {
-			struct hash_rect *n = new_node(df);
-			if (n == NULL)
-				return NULL;
-			n->line = line - df->line;
-			n->rect.x = start_pos;
-			n->rect.y = line->start_line;
-			n->rect.w = width;
-			n->rect.h = line->height;
-			list_add_tail(&n->next_char, &hr->next_char);
+// a touch is the node and the seq of its slot in one word, a reader can't leave it half written.
+// TOUCH_FRAME marks the first use of the node on this frame, the node index is below it
+#define TOUCH_FRAME 0x80000000u
 
-			return n;
-		}
+static inline uint64_t
+touch_slot(unsigned i, uint32_t n) {
+	return (uint64_t)(uint32_t)(i + 1) << 32 | n;
+}
 
-		if (space > max_space) {
-			max_space = space;
-		}
-		start_pos = hr->rect.x + hr->rect.w;
-	}
-	int space = df->width - start_pos;
-	if (space < width) {
-		if (space > max_space) {
-			line->space = space;
-		} else {
-			line->space = max_space;
+static inline void count_frame(struct dfont *df, uint32_t n);
+
+static void
+drain_touch(struct dfont *df) {
+	unsigned head = __atomic_load_n(&df->touch_head, __ATOMIC_ACQUIRE);
+	unsigned i = df->touch_tail;
+	if (head - i > TOUCH_SIZE)
+		i = head - TOUCH_SIZE;	// the oldest touches are overwritten, their version is still set
+	for (;i!=head;i++) {
+		uint64_t t = __atomic_load_n(&df->touch[i % TOUCH_SIZE], __ATOMIC_ACQUIRE);
+		// a slot not written yet is skipped, the touch is lost but the version of the node is set
+		if ((uint32_t)(t >> 32) != (uint32_t)(i + 1))
+			continue;
+		uint32_t n = (uint32_t)t & ~TOUCH_FRAME;
+		// a node evicted since then is in the freelist
+		if (n < (uint32_t)df->max_char && df->node_line[n] >= 0) {
+			// the frames are counted here, the readers can't change the class lists
+			if ((uint32_t)t & TOUCH_FRAME)
+				count_frame(df, n);
+			link_move_tail(df->time_link, n, lru_of(df, n));
 		}
-		return NULL;
 	}
-	struct hash_rect *n = new_node(df);
-	if (n == NULL)
-		return NULL;
-	n->line = line - df->line;
-	n->rect.x = start_pos;
-	n->rect.y = line->start_line;
-	n->rect.w = width;
-	n->rect.h = line->height;
-	list_add_tail(&n->next_char, &line->head);
-
-	return n;
+	df->touch_tail = head;
 }
 
+// the writers take the lock, and only the ones changing the table or the rects bump the sequence
 static void
-adjust_space(struct dfont *df, struct hash_rect *hr) {
-	struct font_line *line = &df->line[hr->line];
-	if (hr->next_char.next == &line->head) {
-		hr->rect.w = df->width - hr->rect.x;
-	} else {
-		struct hash_rect *next = list_entry(hr->next_char.next, struct hash_rect, next_char);
-		hr->rect.w = next->rect.x - hr->rect.x;
-	}
+write_lock(struct dfont *df) {
+	if (!df->concurrent)
+		return;
+	while (__atomic_exchange_n(&df->lock, 1, __ATOMIC_ACQUIRE))
+		cpu_yield();
+	drain_touch(df);
+}
 
-	if (hr->next_char.prev == &line->head) {
-		hr->rect.w += hr->rect.x;
-		hr->rect.x = 0;
-	} else {
-		struct hash_rect *prev = list_entry(hr->next_char.prev, struct hash_rect, next_char);
-		int x = prev->rect.x + prev->rect.w;
-		hr->rect.w += hr->rect.x - x;
-		hr->rect.x = x;
-	}
-	if (hr->rect.w > line->space) {
-		line->space = hr->rect.w;
-	}
-}
-
-static struct hash_rect *
-release_char(struct dfont *df, int c, int font, int edge) {
-	int h = hash(c, font, edge);
-	struct hash_rect *hr = df->hash[h];
-	if (hr->c == c && hr->font == font && hr->edge == edge) {
-		df->hash[h] = hr->next_hash;
-		list_del(&hr->time);
-		adjust_space(df, hr);
-		return hr;
-	}
-	struct hash_rect * last = hr;
-	hr = hr->next_hash;
-	while (hr) {
-		if (c == hr->c && hr->font == font && hr->edge == edge) {
-			last->next_hash = hr->next_hash;
-			list_del(&hr->time);
-			adjust_space(df, hr);
-			return hr;
-		}
-		last = hr;
-		hr = hr->next_hash;
-	}
-	assert(0);
-	return NULL;
+static void
+write_unlock(struct dfont *df) {
+	if (df->concurrent)
+		__atomic_store_n(&df->lock, 0, __ATOMIC_RELEASE);
 }
 
-static struct hash_rect *
-release_space(struct dfont *df, int width, int height) {
-	struct hash_rect *hr, *tmp;
-	list_for_each_entry_safe(hr, struct hash_rect, tmp, &df->time, time) {
-		if (hr->version == df->version)
-			continue;
-		if (hr->rect.h != height) {
-			continue;
-		}
-		struct hash_rect * ret = release_char(df, hr->c, hr->font, hr->edge);
-		int w = hr->rect.w;
-		if (w >= width) {
-			ret->rect.w = width;
-			return ret;
-		} else {
-			list_del(&ret->next_char);
-			ret->next_hash = df->freelist;
-			df->freelist = ret;
-		}
+static void
+write_begin(struct dfont *df) {
+	write_lock(df);
+	if (df->concurrent) {
+		__atomic_store_n(&df->seq, df->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
-	return NULL;
 }
 
-static struct dfont_rect *
-insert_char(struct dfont *df, int c, int font, struct hash_rect *hr, int edge) {
-	hr->c = c;
-	hr->font = font;
-	hr->edge = edge;
-	hr->version = df->version;
-	list_add_tail(&hr->time, &df->time);
-	int h = hash(c, font, edge);
-	hr->next_hash = df->hash[h];
-	df->hash[h] = hr;
-	return &hr->rect;
+static void
+write_end(struct dfont *df) {
+	if (df->concurrent)
+		__atomic_store_n(&df->seq, df->seq + 1, __ATOMIC_RELEASE);
+	write_unlock(df);
 }
 
-const struct dfont_rect * 
-dfont_insert(struct dfont *df, int c, int font, int width, int height, int edge) {
-	if (width > df->width)
-		return NULL;
-	assert(dfont_lookup(df,c,font,edge) == NULL);
-	for (;;) {
-		struct font_line *line = find_line(df, width, height);
-		if (line == NULL)
-			break;
-		struct hash_rect * hr = find_space(df, line, width);
-		if (hr) {
-			return insert_char(df,c,font,hr,edge);
-		}
-	}
-	struct hash_rect * hr = release_space(df, width, height);
-	if (hr) {
-		return insert_char(df,c,font,hr,edge);
+void 
+dfont_flush(struct dfont *df) {
+	write_lock(df);
+	TRACE(df, DFONT_TRACE_FLUSH, 0);
+	__atomic_store_n(&df->version, df->version + 1, __ATOMIC_RELAXED);
+	write_unlock(df);
+}
+
+void
+dfont_remove_key(struct dfont *df, uint64_t key) {
+	write_lock(df);
+	TRACE(df, DFONT_TRACE_REMOVE, key_c(key), key_font(key), key_edge(key));
+	int slot = hash_find(&df->hash, key);
+	if (slot >= 0) {
+		uint32_t n = df->hash.index[slot];
+		df->node_priority[n] = 0;
+		link_move(df->time_link, n, lru_of(df, n));
+		df->node_version[n] = df->version-1;
 	}
-	return NULL;
+	write_unlock(df);
+}
+
+void
+dfont_remove(struct dfont *df, int c, int font, int edge) {
+	dfont_remove_key(df, pack_key(c, font, edge));
 }
 
+// move n to the list of its class after the last char not newer than it, release_space needs them sorted by version
 static void
-dump_node(struct hash_rect *hr) {
-	printf("(%d/%d : %d %d %d %d) ", hr->c, hr->font, hr->rect.x, hr->rect.y, hr->rect.w, hr->rect.h);
+requeue(struct dfont *df, uint32_t n) {
+	struct node_link *l = df->time_link;
+	uint32_t head = lru_of(df, n);
+	link_del(l, n);
+	uint32_t prev = l[head].prev;
+	while (prev != head && (int)(df->node_version[prev] - df->node_version[n]) > 0)
+		prev = l[prev].prev;
+	link_insert(l, n, prev, l[prev].next);
 }
 
-void 
-dfont_dump(struct dfont * df) {
-	printf("version = %d\n",df->version);
-	printf("By version : ");
-	struct hash_rect *hr;
-	int version = -1;
-	list_for_each_entry(hr, struct hash_rect, &df->time, time) {
-		if (hr->version != version) {
-			version = hr->version;
-			printf("\nversion %d : ", version);
+int
+dfont_priority_key(struct dfont *df, uint64_t key, int priority) {
+	if (priority < 0)
+		priority = 0;
+	else if (priority > DFONT_PIN)
+		priority = DFONT_PIN;
+	write_lock(df);
+	TRACE(df, DFONT_TRACE_PRIORITY, key_c(key), key_font(key), key_edge(key), priority);
+	int slot = hash_find(&df->hash, key);
+	if (slot >= 0) {
+		uint32_t n = df->hash.index[slot];
+		if (df->node_priority[n] != priority) {
+			df->node_priority[n] = priority;
+			requeue(df, n);
 		}
-		dump_node(hr);
 	}
-	printf("\n");
-	printf("By line : \n");
-	int i;
-	for (i=0;i<df->max_line;i++) {
-		struct font_line *line = &df->line[i];
-		printf("line (y=%d h=%d space=%d) :",line->start_line, line->height,line->space);
-		list_for_each_entry(hr, struct hash_rect, &line->head, next_char) {
-			printf("%d(%d-%d) ",hr->c,hr->rect.x,hr->rect.x+hr->rect.w-1);
-		}
-		printf("\n");
+	write_unlock(df);
+	return slot >= 0;
+}
+
+int
+dfont_priority(struct dfont *df, int c, int font, int edge, int priority) {
+	return dfont_priority_key(df, pack_key(c, font, edge), priority);
+}
+
+// a char used on PROMOTE_FRAMES frames moves up to class 1, a burst of rare chars stays in class 0 and goes first
+static inline void
+count_frame(struct dfont *df, uint32_t n) {
+	if (df->node_frames[n] < 255 && ++df->node_frames[n] == PROMOTE_FRAMES && df->node_priority[n] == 0)
+		df->node_priority[n] = 1;
+}
+
+static inline struct dfont_rect *
+touch_char(struct dfont *df, int slot) {
+	uint32_t n = df->hash.index[slot];
+	if (df->node_version[n] != df->version)
+		count_frame(df, n);
+	link_move_tail(df->time_link, n, lru_of(df, n));
+	df->node_version[n] = df->version;
+	return &df->node_rect[n];
+}
+
+const struct dfont_rect *
+dfont_lookup_key(struct dfont *df, uint64_t key) {
+	write_lock(df);
+	TRACE(df, DFONT_TRACE_LOOKUP, key_c(key), key_font(key), key_edge(key));
+	int slot = hash_find(&df->hash, key);
+	const struct dfont_rect *rect = NULL;
+	if (slot >= 0) {
+		++df->stat.hit;
+		rect = touch_char(df, slot);
+	} else {
+		++df->stat.miss;
 	}
-	printf("By hash : \n");
-	for (i=0;i<HASH_SIZE;i++) {
-		struct hash_rect *hr = df->hash[i];
-		if (hr) {
-			printf("%d : ",i);
-			while (hr) {
-				dump_node(hr);
-				hr = hr->next_hash;
-			}
+	write_unlock(df);
+	return rect;
+}
 
+const struct dfont_rect * 
+dfont_lookup(struct dfont *df, int c, int font, int edge) {
+	return dfont_lookup_key(df, pack_key(c, font, edge));
+}
+
+// the pointers in a shared dfont are the ones of the owner, another process has the block at another address
+static inline void *
+rebase(struct dfont *df, void *p) {
+	return (char *)p + ((char *)df - (char *)df->base);
+}
+
+static int
+valid_rect(struct dfont *df, const struct dfont_rect *r) {
+	return r->page >= 0 && r->page < df->max_page && r->x >= 0 && r->w >= 0 && r->x + r->w <= df->width
+		&& r->y >= 0 && r->h >= 0 && r->y + r->h <= df->height;
+}
+
+// the lock free lookup, the glyph pixels are copied too when dst is given
+static int
+read_rect(struct dfont *df, uint64_t key, struct dfont_rect *rect, uint8_t *dst, int pitch) {
+	struct hash_table t;
+	const struct dfont_rect *node_rect = (const struct dfont_rect *)rebase(df, df->node_rect);
+	int *node_version = (int *)rebase(df, df->node_version);
+	const uint8_t *node_ready = (const uint8_t *)rebase(df, df->node_ready);
+	const uint8_t *mirror = dst ? (const uint8_t *)rebase(df, df->mirror) : NULL;
+	t.key = (uint64_t *)rebase(df, df->hash.key);
+	t.ctrl = (uint8_t *)rebase(df, df->hash.ctrl);
+	t.index = (uint32_t *)rebase(df, df->hash.index);
+	for (;;) {
+		unsigned seq = __atomic_load_n(&df->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			cpu_yield();
+			continue;
+		}
+		// the reads below may see a half written table, they are only trusted when seq is unchanged
+		t.cap = df->hash.cap;
+		t.shift = df->hash.shift;
+		int slot = hash_find(&t, key);
+		uint32_t index = 0;
+		if (slot >= 0) {
+			index = t.index[slot];
+			if (index >= (uint32_t)df->max_char)
+				slot = -1;
+			else
+				*rect = node_rect[index];
+		}
+		if (slot >= 0 && dst) {
+			// a rect torn by a writer may point anywhere, seq has changed then
+			if (!valid_rect(df, rect))
+				continue;
+			if (!__atomic_load_n(&node_ready[index], __ATOMIC_ACQUIRE)) {
+				slot = -1;
+			} else {
+				const uint8_t *src = mirror + ((size_t)rect->page * df->height + rect->y) * df->width + rect->x;
+				int i;
+				for (i=0;i<rect->h;i++)
+					memcpy(dst + i * pitch, src + i * df->width, rect->w);
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&df->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		// the counters are not atomic here, a few increments from racing readers may be lost
+		uint64_t *counter = slot < 0 ? &df->stat.miss : &df->stat.hit;
+		__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+		if (slot < 0)
+			return 0;
+		// only one reader sees the old version, it counts the frame as touch_char does
+		int version = __atomic_load_n(&df->version, __ATOMIC_RELAXED);
+		int frame = __atomic_exchange_n(&node_version[index], version, __ATOMIC_RELAXED) != version;
+		if (df->concurrent) {
+			unsigned i = __atomic_fetch_add(&df->touch_head, 1, __ATOMIC_ACQ_REL);
+			__atomic_store_n(&df->touch[i % TOUCH_SIZE], touch_slot(i, frame ? index | TOUCH_FRAME : index), __ATOMIC_RELEASE);
+		} else {
+			if (frame)
+				count_frame(df, index);
+			link_move_tail(df->time_link, index, lru_of(df, index));
+		}
+		return 1;
+	}
+}
+
+// the trace file is only open in the owner, the process id is only asked when tracing
+static inline int
+owner_trace(struct dfont *df) {
+	return df->trace != NULL && df->owner == process_id();
+}
+
+int
+dfont_lookup_rect(struct dfont *df, int c, int font, int edge, struct dfont_rect *rect) {
+	if (owner_trace(df))
+		TRACE(df, DFONT_TRACE_LOOKUP, c, font, edge);
+	return read_rect(df, pack_key(c, font, edge), rect, NULL, 0);
+}
+
+int
+dfont_read(struct dfont *df, int c, int font, int edge, struct dfont_rect *rect, void *dst, int pitch) {
+	if (df->mirror == NULL)
+		return 0;
+	if (owner_trace(df))
+		TRACE(df, DFONT_TRACE_LOOKUP, c, font, edge);
+	return read_rect(df, pack_key(c, font, edge), rect, (uint8_t *)dst, pitch);
+}
+
+int
+dfont_lookup_many(struct dfont *df, const int *c, int n, int font, int edge, const struct dfont_rect **rect, struct dfont_miss *miss) {
+	int i;
+	int nmiss = 0;
+	write_lock(df);
+	for (i=0;i<n;i++) {
+		int hint;
+		TRACE(df, DFONT_TRACE_LOOKUP, c[i], font, edge);
+		int slot = hash_probe(&df->hash, pack_key(c[i], font, edge), &hint);
+		if (slot >= 0) {
+			++df->stat.hit;
+			rect[i] = touch_char(df, slot);
+		} else {
+			++df->stat.miss;
+			struct dfont_miss *m = &miss[nmiss++];
+			rect[i] = NULL;
+			m->index = i;
+			m->c = c[i];
+			m->font = font;
+			m->edge = edge;
+			m->slot = hint;
+			m->serial = df->hash.serial;
+		}
+	}
+	write_unlock(df);
+	return nmiss;
+}
+
+static struct font_line *
+split_line(struct dfont *df, struct font_line *line, int height) {
+	if (line->height == height)
+		return line;
+	if (list_empty(&df->idle_line))
+		return NULL;
+	struct font_line * rest = list_entry(df->idle_line.next, struct font_line, order);
+	list_del(&rest->order);
+	rest->page = line->page;
+	rest->start_line = line->start_line + height;
+	rest->height = line->height - height;
+	rest->space = df->width;
+	rest->free = 1;
+	link_init(df->char_link, line_head(df, rest));
+	list_add(&rest->order, &line->order);
+	list_add(&rest->klass, &line->klass);
+	line->height = height;
+	return line;
+}
+
+static struct font_line *
+new_line(struct dfont *df, int height) {
+	// best fit among the free lines, the smallest one that is tall enough
+	struct font_line *line, *best = NULL;
+	int i;
+	for (i=0;i<df->page && (best == NULL || best->height != height);i++) {
+		list_for_each_entry(line, struct font_line, &df->pages[i].free_line, klass) {
+			if (line->height >= height && (best == NULL || line->height < best->height)) {
+				best = line;
+				if (line->height == height)
+					break;
+			}
+		}
+	}
+	if (best == NULL) {
+		// every page is full, open a new one before anything is evicted
+		best = open_page(df);
+	}
+	if (best == NULL || split_line(df, best, height) == NULL)
+		return NULL;
+	best->free = 0;
+	best->dirty_x0 = best->dirty_x1 = 0;
+	best->space = df->width;
+	list_move(&best->klass, &df->klass[height]);
+	return best;
+}
+
+static void
+merge_line(struct dfont *df, struct font_line *line, struct font_line *next) {
+	line->height += next->height;
+	list_del(&next->klass);
+	list_move_tail(&next->order, &df->idle_line);
+}
+
+static void
+release_line(struct dfont *df, struct font_line *line) {
+	struct font_page *p = &df->pages[line->page];
+	line->free = 1;
+	line->space = df->width;
+	list_move(&line->klass, &p->free_line);
+	if (line->order.next != &p->order) {
+		struct font_line *next = list_entry(line->order.next, struct font_line, order);
+		if (next->free)
+			merge_line(df, line, next);
+	}
+	if (line->order.prev != &p->order) {
+		struct font_line *prev = list_entry(line->order.prev, struct font_line, order);
+		if (prev->free)
+			merge_line(df, prev, line);
+	}
+}
+
+static struct font_line *
+find_line(struct dfont *df, int width, int height) {
+	if (height > df->height)
+		return NULL;
+	// lines with free space are kept at the front of their class, see find_space and adjust_space
+	struct font_line *line;
+	list_for_each_entry(line, struct font_line, &df->klass[height], klass) {
+		if (width <= line->space) {
+			return line;
+		}
+	}
+	return new_line(df, height);
+}
+
+static int
+new_node(struct dfont *df) {
+	uint32_t head = free_head(df);
+	if (link_empty(df->time_link, head))
+		return -1;
+	uint32_t n = df->time_link[head].next;
+	link_del(df->time_link, n);
+	return n;
+}
+
+static int
+place_node(struct dfont *df, struct font_line *line, int x, int width, uint32_t before) {
+	int n = new_node(df);
+	if (n < 0)
+		return -1;
+	struct dfont_rect *r = &df->node_rect[n];
+	df->node_line[n] = line - df->line;
+	r->x = x;
+	r->y = line->start_line;
+	r->w = width;
+	r->h = line->height;	// the glyph height is set by insert_char
+	r->page = line->page;
+	link_add_tail(df->char_link, n, before);
+	return n;
+}
+
+static int
+find_space(struct dfont *df, struct font_line *line, int width) {
+	struct node_link *l = df->char_link;
+	struct dfont_rect *rect = df->node_rect;
+	uint32_t head = line_head(df, line);
+	uint32_t n;
+	int start_pos = 0;
+	int max_space = 0;
+	if (!link_empty(l, head)) {
+		// fast path : append after the last char
+		n = l[head].prev;
+		start_pos = rect[n].x + rect[n].w;
+		if (df->width - start_pos >= width)
+			return place_node(df, line, start_pos, width, head);
+		start_pos = 0;
+	}
+	link_for_each(n, l, head) {
+		int space = rect[n].x - start_pos;
+		if (space >= width) {
+			return place_node(df, line, start_pos, width, n);
+		}
+
+		if (space > max_space) {
+			max_space = space;
+		}
+		start_pos = rect[n].x + rect[n].w;
+	}
+	int space = df->width - start_pos;
+	if (space < width) {
+		if (space > max_space) {
+			line->space = space;
+		} else {
+			line->space = max_space;
+		}
+		list_move_tail(&line->klass, &df->klass[line->height]);
+		return -1;
+	}
+	return place_node(df, line, start_pos, width, head);
+}
+
+static void
+adjust_space(struct dfont *df, uint32_t n) {
+	struct font_line *line = &df->line[df->node_line[n]];
+	struct node_link *l = &df->char_link[n];
+	struct dfont_rect *r = &df->node_rect[n];
+	uint32_t head = line_head(df, line);
+	if (l->next == head) {
+		r->w = df->width - r->x;
+	} else {
+		r->w = df->node_rect[l->next].x - r->x;
+	}
+
+	if (l->prev == head) {
+		r->w += r->x;
+		r->x = 0;
+	} else {
+		struct dfont_rect *prev = &df->node_rect[l->prev];
+		int x = prev->x + prev->w;
+		r->w += r->x - x;
+		r->x = x;
+	}
+	if (r->w > line->space) {
+		line->space = r->w;
+		list_move(&line->klass, &df->klass[line->height]);
+	}
+}
+
+static uint32_t
+release_char(struct dfont *df, uint32_t n) {
+	int slot = hash_find(&df->hash, df->node_key[n]);
+	assert(slot >= 0 && df->hash.index[slot] == n);
+	hash_erase(&df->hash, slot);
+	link_del(df->time_link, n);
+	adjust_space(df, n);
+	return n;
+}
+
+static void
+free_node(struct dfont *df, uint32_t n) {
+	df->node_line[n] = -1;
+	link_del(df->char_link, n);
+	link_add(df->time_link, n, free_head(df));
+}
+
+static int
+line_expired(struct dfont *df, struct font_line *line) {
+	uint32_t n, head = line_head(df, line);
+	link_for_each(n, df->char_link, head) {
+		if (!expired(df, n))
+			return 0;
+	}
+	return 1;
+}
+
+void
+dfont_erase_key(struct dfont *df, uint64_t key) {
+	write_begin(df);
+	TRACE(df, DFONT_TRACE_ERASE, key_c(key), key_font(key), key_edge(key));
+	int slot = hash_find(&df->hash, key);
+	if (slot >= 0) {
+		uint32_t n = df->hash.index[slot];
+		struct font_line *line = &df->line[df->node_line[n]];
+		free_node(df, release_char(df, n));
+		if (link_empty(df->char_link, line_head(df, line)))
+			release_line(df, line);
+	}
+	write_end(df);
+}
+
+void
+dfont_erase(struct dfont *df, int c, int font, int edge) {
+	dfont_erase_key(df, pack_key(c, font, edge));
+}
+
+static int
+evict_line(struct dfont *df, struct font_line *line) {
+	uint32_t head = line_head(df, line);
+	int count = 0;
+	while (!link_empty(df->char_link, head)) {
+		free_node(df, release_char(df, df->char_link[head].next));
+		++count;
+	}
+	release_line(df, line);
+	return count;
+}
+
+static int
+release_line_space(struct dfont *df, int width, int height) {
+	// drop whole lines of other heights when none of their chars is in use
+	int i;
+	for (i=0;i<df->page;i++) {
+		struct font_page *p = &df->pages[i];
+		struct font_line *line, *tmp;
+		list_for_each_entry_safe(line, struct font_line, tmp, &p->order, order) {
+			if (line->free || line->height == height || !line_expired(df, line))
+				continue;
+			df->stat.evict_line += evict_line(df, line);
+			struct font_line *nl = new_line(df, height);
+			if (nl)
+				return find_space(df, nl, width);
+			// the merged free lines may have been recycled, restart the scan
+			tmp = list_entry(p->order.next, struct font_line, order);
+		}
+	}
+	return -1;
+}
+
+// an expired neighbour in the line, its space can join the hole left by n
+static int
+stale_neighbour(struct dfont *df, uint32_t n) {
+	uint32_t head = line_head(df, &df->line[df->node_line[n]]);
+	struct node_link *l = &df->char_link[n];
+	if (l->next != head && expired(df, l->next))
+		return l->next;
+	if (l->prev != head && expired(df, l->prev))
+		return l->prev;
+	return -1;
+}
+
+static int
+release_space(struct dfont *df, int width, int height) {
+	struct node_link *l = df->time_link;
+	int p;
+	// the lower classes first, their chars are rare or were not wanted
+	for (p=0;p<DFONT_PIN;p++) {
+		uint32_t lru = lru_head(df, height, p);
+		int requeued = -1;
+		while (!link_empty(l, lru)) {
+			// the chars are queued by version, the oldest is first, so none can go when the first is in use
+			uint32_t n = l[lru].next;
+			if (!expired(df, n)) {
+				// a deferred touch of dfont_lookup_rect leaves a newer char out of order, queue it again once
+				if ((int)n == requeued || !df->concurrent)
+					break;
+				if (requeued < 0)
+					requeued = n;
+				link_move_tail(l, n, lru);
+				continue;
+			}
+			uint32_t ret = release_char(df, n);
+			++df->stat.evict_lru;
+			while (df->node_rect[ret].w < width) {
+				// merge the hole with the stale neighbours until the glyph fits
+				int next = stale_neighbour(df, ret);
+				if (next < 0)
+					break;
+				free_node(df, ret);
+				ret = release_char(df, next);
+				++df->stat.evict_lru;
+			}
+			if (df->node_rect[ret].w >= width) {
+				df->node_rect[ret].w = width;
+				return ret;
+			} else {
+				struct font_line *line = &df->line[df->node_line[ret]];
+				free_node(df, ret);
+				if (link_empty(df->char_link, line_head(df, line))) {
+					// give the empty line back, its rows can be reused by any height
+					release_line(df, line);
+					line = new_line(df, height);
+					if (line)
+						return find_space(df, line, width);
+				}
+			}
+		}
+	}
+	return release_line_space(df, width, height);
+}
+
+static struct dfont_rect *
+insert_char(struct dfont *df, uint32_t n, const struct dfont_miss *m, uint64_t key, int height) {
+	df->node_rect[n].h = height;
+	df->node_key[n] = key;
+	df->node_version[n] = df->version;
+	df->node_ready[n] = 0;
+	df->node_priority[n] = 0;
+	df->node_frames[n] = 1;
+	++df->stat.insert;
+	hash_insert(df, key, n, m->slot);
+	link_add_tail(df->time_link, n, lru_of(df, n));
+	return &df->node_rect[n];
+}
+
+static const struct dfont_rect *
+insert_miss(struct dfont *df, const struct dfont_miss *miss, int width, int height) {
+	if (width > df->width || height > df->height || height <= 0)
+		return NULL;
+	int line_height = df->height_class[height];
+	uint64_t key = pack_key(miss->c, miss->font, miss->edge);
+	struct hash_table *t = &df->hash;
+	struct dfont_miss m = *miss;
+	// the char may be in already when it is repeated in the string, or another thread put it in a slot freed since the lookup
+	int hint;
+	int slot = hash_probe(t, key, &hint);
+	if (slot >= 0)
+		return touch_char(df, slot);
+	if (m.serial != t->serial || (t->ctrl[m.slot] & CTRL_EMPTY) == 0) {
+		// the reserved slot is gone
+		m.slot = hint;
+	}
+	while (!link_empty(df->time_link, free_head(df))) {
+		struct font_line *line = find_line(df, width, line_height);
+		if (line == NULL)
+			break;
+		int n = find_space(df, line, width);
+		if (n >= 0) {
+			return insert_char(df, n, &m, key, height);
+		}
+	}
+	// evicting only erases slots, the reserved one stays free
+	int n = release_space(df, width, line_height);
+	if (n >= 0) {
+		return insert_char(df, n, &m, key, height);
+	}
+	++df->stat.failed;
+	return NULL;
+}
+
+const struct dfont_rect *
+dfont_insert_miss(struct dfont *df, const struct dfont_miss *miss, int width, int height) {
+	write_begin(df);
+	TRACE(df, DFONT_TRACE_INSERT, miss->c, miss->font, width, height, miss->edge);
+	const struct dfont_rect *rect = insert_miss(df, miss, width, height);
+	write_end(df);
+	return rect;
+}
+
+const struct dfont_rect *
+dfont_insert_key(struct dfont *df, uint64_t key, int width, int height) {
+	struct dfont_miss m;
+	write_begin(df);
+	TRACE(df, DFONT_TRACE_INSERT, key_c(key), key_font(key), width, height, key_edge(key));
+	int slot = hash_probe(&df->hash, key, &m.slot);
+	// another thread may have inserted it since the caller looked
+	assert(slot < 0 || df->concurrent);
+	const struct dfont_rect *rect;
+	if (slot >= 0) {
+		rect = touch_char(df, slot);
+	} else {
+		m.index = 0;
+		m.c = key_c(key);
+		m.font = key_font(key);
+		m.edge = key_edge(key);
+		m.serial = df->hash.serial;
+		rect = insert_miss(df, &m, width, height);
+	}
+	write_end(df);
+	return rect;
+}
+
+const struct dfont_rect * 
+dfont_insert(struct dfont *df, int c, int font, int width, int height, int edge) {
+	return dfont_insert_key(df, pack_key(c, font, edge), width, height);
+}
+
+static int
+evict_page(struct dfont *df, int page) {
+	if (page < 0 || page >= df->page)
+		return 0;
+	int n = 0;
+	struct font_page *p = &df->pages[page];
+	for (;;) {
+		// release_line merges the free neighbours, so look for the next line from the start
+		struct font_line *line, *used = NULL;
+		list_for_each_entry(line, struct font_line, &p->order, order) {
+			if (!line->free) {
+				used = line;
+				break;
+			}
+		}
+		if (used == NULL)
+			break;
+		n += evict_line(df, used);
+	}
+	df->stat.evict_page += n;
+	return n;
+}
+
+int
+dfont_evict_page(struct dfont *df, int page) {
+	write_begin(df);
+	TRACE(df, DFONT_TRACE_EVICT_PAGE, page);
+	int n = evict_page(df, page);
+	write_end(df);
+	return n;
+}
+
+static uint8_t *
+mirror_at(struct dfont *df, int page, int x, int y) {
+	return df->mirror + ((size_t)page * df->height + y) * df->width + x;
+}
+
+static void
+mark_dirty(struct font_line *line, int x, int w) {
+	if (line->dirty_x1 == 0) {
+		line->dirty_x0 = x;
+		line->dirty_x1 = x + w;
+	} else {
+		if (x < line->dirty_x0)
+			line->dirty_x0 = x;
+		if (x + w > line->dirty_x1)
+			line->dirty_x1 = x + w;
+	}
+}
+
+static void
+copy_rect(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch, int w, int h) {
+	int i;
+	for (i=0;i<h;i++) {
+		memcpy(dst, src, w);
+		dst += dst_pitch;
+		src += src_pitch;
+	}
+}
+
+// the bytes mirror_moves saves the sources in
+static size_t
+moves_size(const struct dfont_move *moves, int n) {
+	size_t size = 0;
+	int i;
+	for (i=0;i<n;i++)
+		size += (size_t)moves[i].src.w * moves[i].src.h;
+	return size;
+}
+
+// the sources may overlap the destinations, so every source is saved in tmp first
+static void
+mirror_moves(struct dfont *df, int page, const struct dfont_move *moves, int n, uint8_t *tmp) {
+	int i;
+	uint8_t *ptr = tmp;
+	for (i=0;i<n;i++) {
+		const struct dfont_rect *r = &moves[i].src;
+		copy_rect(ptr, r->w, mirror_at(df, page, r->x, r->y), df->width, r->w, r->h);
+		ptr += r->w * r->h;
+	}
+	ptr = tmp;
+	for (i=0;i<n;i++) {
+		const struct dfont_rect *r = &moves[i].dst;
+		copy_rect(mirror_at(df, page, r->x, r->y), df->width, ptr, r->w, r->w, r->h);
+		ptr += r->w * r->h;
+	}
+	struct font_line *line;
+	list_for_each_entry(line, struct font_line, &df->pages[page].order, order) {
+		if (!line->free && line->space < df->width)
+			mark_dirty(line, 0, df->width - line->space);
+	}
+}
+
+void
+dfont_mirror(struct dfont *df, void *pixels) {
+	write_lock(df);
+	df->mirror = (uint8_t *)pixels;
+	write_unlock(df);
+}
+
+size_t
+dfont_mirror_size(struct dfont *df) {
+	return (size_t)df->width * df->height * df->max_page;
+}
+
+static inline int
+mirror_rect(struct dfont *df, const struct dfont_rect *rect) {
+	return df->mirror != NULL && rect >= df->node_rect && rect < df->node_rect + df->max_char;
+}
+
+static void
+write_done(struct dfont *df, const struct dfont_rect *rect) {
+	uint32_t n = rect - df->node_rect;
+	mark_dirty(&df->line[df->node_line[n]], rect->x, rect->w);
+	__atomic_store_n(&df->node_ready[n], 1, __ATOMIC_RELEASE);
+}
+
+int
+dfont_write(struct dfont *df, const struct dfont_rect *rect, const void *src, int pitch) {
+	if (!mirror_rect(df, rect))
+		return 0;
+	write_lock(df);
+	copy_rect(mirror_at(df, rect->page, rect->x, rect->y), df->width, (const uint8_t *)src, pitch, rect->w, rect->h);
+	write_done(df, rect);
+	write_unlock(df);
+	return 1;
+}
+
+void *
+dfont_write_rect(struct dfont *df, const struct dfont_rect *rect, int *pitch) {
+	if (!mirror_rect(df, rect))
+		return NULL;
+	// the rect is not ready, no reader looks at its pixels until dfont_write_done
+	*pitch = df->width;
+	return mirror_at(df, rect->page, rect->x, rect->y);
+}
+
+int
+dfont_write_done(struct dfont *df, const struct dfont_rect *rect) {
+	if (!mirror_rect(df, rect))
+		return 0;
+	write_lock(df);
+	write_done(df, rect);
+	write_unlock(df);
+	return 1;
+}
+
+int
+dfont_flush_uploads(struct dfont *df, dfont_upload upload, void *ud) {
+	int n = 0;
+	int i;
+	write_lock(df);
+	for (i=0;i<df->page;i++) {
+		// the dirty spans of consecutive lines go in one upload, unless the union is more than twice their area
+		int x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+		int area = 0;
+		struct font_line *line;
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			if (line->free || line->dirty_x1 == 0) {
+				continue;
+			}
+			int lx0 = line->dirty_x0, lx1 = line->dirty_x1;
+			line->dirty_x0 = line->dirty_x1 = 0;
+			if (x1 > 0 && y1 == line->start_line) {
+				int ux0 = lx0 < x0 ? lx0 : x0;
+				int ux1 = lx1 > x1 ? lx1 : x1;
+				int larea = (lx1 - lx0) * line->height;
+				if ((ux1 - ux0) * (y1 + line->height - y0) <= 2 * (area + larea)) {
+					x0 = ux0;
+					x1 = ux1;
+					y1 += line->height;
+					area += larea;
+					continue;
+				}
+			}
+			if (x1 > 0) {
+				upload(ud, i, x0, y0, x1 - x0, y1 - y0, mirror_at(df, i, x0, y0), df->width);
+				++n;
+			}
+			x0 = lx0;
+			x1 = lx1;
+			y0 = line->start_line;
+			y1 = y0 + line->height;
+			area = (x1 - x0) * line->height;
+		}
+		if (x1 > 0) {
+			upload(ud, i, x0, y0, x1 - x0, y1 - y0, mirror_at(df, i, x0, y0), df->width);
+			++n;
+		}
+	}
+	write_unlock(df);
+	return n;
+}
+
+struct compact_item {
+	uint32_t node;
+	int height;
+	int w;
+	int x;
+	int shelf;
+};
+
+struct compact_shelf {
+	int y;
+	int height;
+	int used;
+	int line;
+};
+
+static int
+compact_order(const void *a, const void *b) {
+	const struct compact_item *x = (const struct compact_item *)a;
+	const struct compact_item *y = (const struct compact_item *)b;
+	if (x->height != y->height)
+		return y->height - x->height;
+	if (x->w != y->w)
+		return y->w - x->w;
+	return (int)x->node - (int)y->node;
+}
+
+static int
+count_idle(struct dfont *df) {
+	int n = 0;
+	struct list_head *pos;
+	list_for_each(pos, &df->idle_line) {
+		++n;
+	}
+	return n;
+}
+
+static void
+rebuild_page(struct dfont *df, int page, struct compact_item *item, int n, struct compact_shelf *shelf, int nshelf) {
+	struct font_page *p = &df->pages[page];
+	struct font_line *line, *tmp;
+	list_for_each_entry_safe(line, struct font_line, tmp, &p->order, order) {
+		list_del(&line->klass);
+		list_move_tail(&line->order, &df->idle_line);
+	}
+	INIT_LIST_HEAD(&p->free_line);
+	int i;
+	int top = 0;
+	for (i=0;i<=nshelf;i++) {
+		int height = i < nshelf ? shelf[i].height : df->height - top;
+		if (height == 0)
+			break;
+		line = list_entry(df->idle_line.next, struct font_line, order);
+		list_move_tail(&line->order, &p->order);
+		line->page = page;
+		line->start_line = top;
+		line->height = height;
+		link_init(df->char_link, line_head(df, line));
+		if (i < nshelf) {
+			line->free = 0;
+			line->dirty_x0 = line->dirty_x1 = 0;
+			line->space = df->width - shelf[i].used;
+			if (line->space > 0)
+				list_add(&line->klass, &df->klass[height]);
+			else
+				list_add_tail(&line->klass, &df->klass[height]);
+			shelf[i].line = line - df->line;
+		} else {
+			line->free = 1;
+			line->space = df->width;
+			list_add(&line->klass, &p->free_line);
+		}
+		top += height;
+	}
+	for (i=0;i<n;i++) {
+		uint32_t n = item[i].node;
+		line = &df->line[shelf[item[i].shelf].line];
+		df->node_line[n] = line - df->line;
+		df->node_rect[n].x = item[i].x;
+		df->node_rect[n].y = line->start_line;
+		link_add_tail(df->char_link, n, line_head(df, line));
+	}
+}
+
+static int
+compact(struct dfont *df, int page, struct dfont_move *moves, int max_moves) {
+	if (page < 0 || page >= df->page)
+		return 0;
+	struct font_page *p = &df->pages[page];
+	struct font_line *line;
+	struct dfont_rect *r;
+	uint32_t node;
+	int n = 0;
+	int nline = 0;
+	list_for_each_entry(line, struct font_line, &p->order, order) {
+		++nline;
+		link_for_each(node, df->char_link, line_head(df, line)) {
+			++n;
+		}
+	}
+	struct compact_item *item = (struct compact_item *)malloc(n * sizeof(*item) + n * sizeof(struct compact_shelf) + 1);
+	if (item == NULL)
+		return -1;
+	struct compact_shelf *shelf = (struct compact_shelf *)(item + n);
+	int i = 0;
+	list_for_each_entry(line, struct font_line, &p->order, order) {
+		link_for_each(node, df->char_link, line_head(df, line)) {
+			item[i].node = node;
+			item[i].height = line->height;
+			item[i].w = df->node_rect[node].w;
+			++i;
+		}
+	}
+	qsort(item, n, sizeof(*item), compact_order);
+
+	// first fit decreasing, the tallest lines go to the top and the free rows gather at the bottom
+	int nshelf = 0;
+	int first = 0;
+	int top = 0;
+	int nmove = 0;
+	for (i=0;i<n;i++) {
+		int w = item[i].w;
+		int s;
+		if (i > 0 && item[i].height != item[i-1].height)
+			first = nshelf;
+		for (s=first;s<nshelf;s++) {
+			if (shelf[s].used + w <= df->width)
+				break;
+		}
+		if (s == nshelf) {
+			if (top + item[i].height > df->height) {
+				free(item);
+				return -1;
+			}
+			shelf[s].y = top;
+			shelf[s].height = item[i].height;
+			shelf[s].used = 0;
+			top += item[i].height;
+			++nshelf;
+		}
+		item[i].shelf = s;
+		item[i].x = shelf[s].used;
+		shelf[s].used += w;
+		r = &df->node_rect[item[i].node];
+		if (r->x != item[i].x || r->y != shelf[s].y)
+			++nmove;
+	}
+	if (nmove > max_moves || nshelf + 1 > count_idle(df) + nline) {
+		free(item);
+		return nmove > max_moves ? nmove : -1;
+	}
+	nmove = 0;
+	for (i=0;i<n;i++) {
+		r = &df->node_rect[item[i].node];
+		struct compact_shelf *sh = &shelf[item[i].shelf];
+		if (r->x != item[i].x || r->y != sh->y) {
+			struct dfont_move *m = &moves[nmove++];
+			m->src = *r;
+			m->dst = *r;
+			m->dst.x = item[i].x;
+			m->dst.y = sh->y;
+		}
+	}
+	// allocated before the page is rebuilt, the page is left as it was when it fails
+	uint8_t *tmp = NULL;
+	if (df->mirror) {
+		tmp = (uint8_t *)malloc(moves_size(moves, nmove) + 1);
+		if (tmp == NULL) {
+			free(item);
+			return -1;
+		}
+	}
+	rebuild_page(df, page, item, n, shelf, nshelf);
+	free(item);
+	if (tmp) {
+		mirror_moves(df, page, moves, nmove, tmp);
+		free(tmp);
+	}
+	return nmove;
+}
+
+int
+dfont_compact(struct dfont *df, int page, struct dfont_move *moves, int max_moves) {
+	write_begin(df);
+	TRACE(df, DFONT_TRACE_COMPACT, page, max_moves);
+	int n = compact(df, page, moves, max_moves);
+	write_end(df);
+	return n;
+}
+
+static void
+line_stats(struct dfont *df, struct font_line *line, struct dfont_line_stats *ls) {
+	uint32_t n;
+	int x = 0;
+	ls->page = line->page;
+	ls->y = line->start_line;
+	ls->height = line->height;
+	ls->rects = 0;
+	ls->used = 0;
+	ls->hole = 0;
+	link_for_each(n, df->char_link, line_head(df, line)) {
+		const struct dfont_rect *r = &df->node_rect[n];
+		if (r->x - x > ls->hole)
+			ls->hole = r->x - x;
+		x = r->x + r->w;
+		ls->used += r->w;
+		++ls->rects;
+	}
+	if (df->width - x > ls->hole)
+		ls->hole = df->width - x;
+}
+
+void
+dfont_stats(struct dfont *df, struct dfont_stats *stats) {
+	write_lock(df);
+	*stats = df->stat;
+	stats->pages = df->page;
+	stats->lines = 0;
+	stats->rects = 0;
+	stats->working_set = 0;
+	stats->pixels = 0;
+	stats->class_waste = 0;
+	stats->line_pixels = 0;
+	stats->total_pixels = (uint64_t)df->width * df->height * df->page;
+	stats->working_pixels = 0;
+	stats->fragmentation = 0;
+	int nfrag = 0;
+	int i;
+	for (i=0;i<df->page;i++) {
+		struct font_line *line;
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			if (line->free)
+				continue;
+			struct dfont_line_stats ls;
+			uint32_t n;
+			line_stats(df, line, &ls);
+			++stats->lines;
+			stats->rects += ls.rects;
+			stats->line_pixels += (uint64_t)df->width * ls.height;
+			if (ls.used < df->width) {
+				stats->fragmentation += 1.0f - (float)ls.hole / (df->width - ls.used);
+				++nfrag;
+			}
+			link_for_each(n, df->char_link, line_head(df, line)) {
+				const struct dfont_rect *r = &df->node_rect[n];
+				stats->pixels += (uint64_t)r->w * r->h;
+				stats->class_waste += (uint64_t)r->w * (line->height - r->h);
+				if (df->node_version[n] == df->version) {
+					++stats->working_set;
+					stats->working_pixels += (uint64_t)r->w * r->h;
+				}
+			}
+		}
+	}
+	if (nfrag > 0)
+		stats->fragmentation /= nfrag;
+	write_unlock(df);
+}
+
+int
+dfont_line_stats(struct dfont *df, struct dfont_line_stats *lines, int max_lines) {
+	int n = 0;
+	int i;
+	write_lock(df);
+	for (i=0;i<df->page;i++) {
+		struct font_line *line;
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			if (line->free)
+				continue;
+			if (n < max_lines)
+				line_stats(df, line, &lines[n]);
+			++n;
+		}
+	}
+	write_unlock(df);
+	return n;
+}
+
+// snapshot : header | lines | chars | pixels of every page, only offsets inside, so it can be mapped anywhere
+#define SNAPSHOT_MAGIC 0x31534644	// "DFS1"
+#define SNAPSHOT_ALIGN 64
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t header_size;
+	uint64_t fingerprint;
+	uint64_t size;
+	int32_t width;
+	int32_t height;
+	int32_t pages;
+	int32_t lines;
+	int32_t chars;
+	uint32_t line_offset;
+	uint32_t char_offset;
+	uint32_t pixel_offset;
+};
+
+struct snapshot_line {
+	int32_t page;
+	int32_t y;
+	int32_t height;
+};
+
+struct snapshot_char {
+	int32_t c;
+	int32_t font;
+	int32_t edge;
+	int32_t line;
+	int32_t x;
+	int32_t w;
+	int32_t h;
+};
+
+static void
+snapshot_layout(struct snapshot_header *h, int width, int height, int pages, int lines, int chars) {
+	h->magic = SNAPSHOT_MAGIC;
+	h->header_size = sizeof(*h);
+	h->width = width;
+	h->height = height;
+	h->pages = pages;
+	h->lines = lines;
+	h->chars = chars;
+	h->line_offset = sizeof(*h);
+	h->char_offset = h->line_offset + lines * sizeof(struct snapshot_line);
+	h->pixel_offset = h->char_offset + chars * sizeof(struct snapshot_char);
+	h->pixel_offset = (h->pixel_offset + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1);
+	h->size = h->pixel_offset + (uint64_t)width * height * pages;
+}
+
+static void
+snapshot_count(struct dfont *df, int *lines, int *chars) {
+	int i;
+	*lines = 0;
+	*chars = 0;
+	for (i=0;i<df->page;i++) {
+		struct font_line *line;
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			uint32_t n;
+			if (line->free)
+				continue;
+			++*lines;
+			link_for_each(n, df->char_link, line_head(df, line)) {
+				++*chars;
+			}
+		}
+	}
+}
+
+size_t
+dfont_snapshot_size(struct dfont *df) {
+	struct snapshot_header h;
+	int lines, chars;
+	write_lock(df);
+	snapshot_count(df, &lines, &chars);
+	snapshot_layout(&h, df->width, df->height, df->page, lines, chars);
+	write_unlock(df);
+	return h.size;
+}
+
+size_t
+dfont_snapshot(struct dfont *df, uint64_t fingerprint, const void * const *pixels, void *buffer, size_t size) {
+	struct snapshot_header h;
+	int lines, chars;
+	write_lock(df);
+	snapshot_count(df, &lines, &chars);
+	snapshot_layout(&h, df->width, df->height, df->page, lines, chars);
+	if (h.size > size || (pixels == NULL && df->mirror == NULL)) {
+		write_unlock(df);
+		return 0;
+	}
+	h.fingerprint = fingerprint;
+	char *ptr = (char *)buffer;
+	struct snapshot_line *sl = (struct snapshot_line *)(ptr + h.line_offset);
+	struct snapshot_char *sc = (struct snapshot_char *)(ptr + h.char_offset);
+	int i;
+	int n = 0;
+	for (i=0;i<df->page;i++) {
+		struct font_line *line;
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			uint32_t node;
+			if (line->free)
+				continue;
+			sl->page = line->page;
+			sl->y = line->start_line;
+			sl->height = line->height;
+			++sl;
+			link_for_each(node, df->char_link, line_head(df, line)) {
+				uint64_t key = df->node_key[node];
+				sc->c = key_c(key);
+				sc->font = key_font(key);
+				sc->edge = key_edge(key);
+				sc->line = n;
+				sc->x = df->node_rect[node].x;
+				sc->w = df->node_rect[node].w;
+				sc->h = df->node_rect[node].h;
+				++sc;
+			}
+			++n;
+		}
+	}
+	memset(sc, 0, ptr + h.pixel_offset - (char *)sc);
+	size_t page_size = (size_t)df->width * df->height;
+	for (i=0;i<df->page;i++) {
+		const void *src = pixels ? pixels[i] : mirror_at(df, i, 0, 0);
+		memcpy(ptr + h.pixel_offset + page_size * i, src, page_size);
+	}
+	memcpy(ptr, &h, sizeof(h));
+	write_unlock(df);
+	return h.size;
+}
+
+static const struct snapshot_header *
+snapshot_check(struct dfont *df, uint64_t fingerprint, const void *snapshot, size_t size) {
+	const struct snapshot_header *h = (const struct snapshot_header *)snapshot;
+	struct snapshot_header layout;
+	if (size < sizeof(*h) || h->magic != SNAPSHOT_MAGIC || h->header_size != sizeof(*h))
+		return NULL;
+	if (h->fingerprint != fingerprint || h->width != df->width || h->height != df->height)
+		return NULL;
+	if (h->pages < 1 || h->pages > df->max_page || h->lines < 0 || h->chars < 0 || h->chars > df->max_char)
+		return NULL;
+	snapshot_layout(&layout, h->width, h->height, h->pages, h->lines, h->chars);
+	if (layout.size != h->size || layout.pixel_offset != h->pixel_offset || h->size > size)
+		return NULL;
+	return h;
+}
+
+// take the rows y to y+height from the free line covering them, the rows above y stay free
+static struct font_line *
+claim_line(struct dfont *df, struct font_line *line, int y, int height) {
+	if (y > line->start_line) {
+		if (split_line(df, line, y - line->start_line) == NULL)
+			return NULL;
+		line = list_entry(line->order.next, struct font_line, order);
+	}
+	if (split_line(df, line, height) == NULL)
+		return NULL;
+	line->free = 0;
+	line->dirty_x0 = line->dirty_x1 = 0;
+	list_move(&line->klass, &df->klass[height]);
+	return line;
+}
+
+static int
+restore(struct dfont *df, const struct snapshot_header *h, struct font_line **lines) {
+	const char *ptr = (const char *)h;
+	const struct snapshot_line *sl = (const struct snapshot_line *)(ptr + h->line_offset);
+	const struct snapshot_char *sc = (const struct snapshot_char *)(ptr + h->char_offset);
+	int i;
+	reset(df);
+	while (df->page < h->pages)
+		open_page(df);
+	// lines are sorted by page and y, so the last line of the page is always the free one to claim from
+	for (i=0;i<h->lines;i++) {
+		if (sl[i].page < 0 || sl[i].page >= h->pages || sl[i].height <= 0 || sl[i].height > df->height)
+			return 0;
+		struct font_page *p = &df->pages[sl[i].page];
+		struct font_line *line = list_entry(p->order.prev, struct font_line, order);
+		if (!line->free || sl[i].y < line->start_line || sl[i].y + sl[i].height > df->height)
+			return 0;
+		line = claim_line(df, line, sl[i].y, sl[i].height);
+		if (line == NULL)
+			return 0;
+		line->space = 0;
+		lines[i] = line;
+	}
+	int n = -1;
+	int x = 0;
+	for (i=0;i<h->chars;i++) {
+		if (sc[i].line < n || sc[i].line >= h->lines)
+			return 0;
+		if (sc[i].line != n) {
+			n = sc[i].line;
+			x = 0;
+		}
+		if (sc[i].x < x || sc[i].w <= 0 || sc[i].x + sc[i].w > df->width)
+			return 0;
+		if (sc[i].font < 0 || sc[i].font >= 0x1000000 || sc[i].edge < 0 || sc[i].edge >= 0x100)
+			return 0;
+		x = sc[i].x + sc[i].w;
+		struct font_line *line = lines[n];
+		if (sc[i].h <= 0 || sc[i].h > line->height)
+			return 0;
+		struct dfont_miss m;
+		uint64_t key = pack_key(sc[i].c, sc[i].font, sc[i].edge);
+		if (hash_probe(&df->hash, key, &m.slot) >= 0)
+			return 0;
+		int node = place_node(df, line, sc[i].x, sc[i].w, line_head(df, line));
+		if (node < 0)
+			return 0;
+		insert_char(df, node, &m, key, sc[i].h);
+		--df->stat.insert;
+		// nothing is drawn with it yet
+		df->node_version[node] = df->version - 1;
+		df->node_ready[node] = df->mirror != NULL;
+	}
+	// the lines get their widest hole back, the fast path of find_space appends after the last char
+	for (i=0;i<df->page;i++) {
+		struct font_line *line;
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			if (line->free)
+				continue;
+			struct dfont_line_stats ls;
+			line_stats(df, line, &ls);
+			line->space = ls.hole;
+			if (line->space > 0)
+				list_move(&line->klass, &df->klass[line->height]);
+			if (df->mirror)
+				mark_dirty(line, 0, df->width);
+		}
+	}
+	if (df->mirror)
+		memcpy(df->mirror, ptr + h->pixel_offset, (size_t)df->width * df->height * h->pages);
+	return 1;
+}
+
+int
+dfont_restore(struct dfont *df, uint64_t fingerprint, const void *snapshot, size_t size) {
+	const struct snapshot_header *h = snapshot_check(df, fingerprint, snapshot, size);
+	if (h == NULL)
+		return 0;
+	// before the index is torn down, the dfont is left as it was when it fails
+	struct font_line **lines = (struct font_line **)malloc(h->lines * sizeof(*lines) + 1);
+	if (lines == NULL)
+		return 0;
+	write_begin(df);
+	int ok = restore(df, h, lines);
+	if (!ok)
+		reset(df);
+	write_end(df);
+	free(lines);
+	return ok;
+}
+
+const void *
+dfont_snapshot_pixels(const void *snapshot, size_t size, int page) {
+	const struct snapshot_header *h = (const struct snapshot_header *)snapshot;
+	if (size < sizeof(*h) || h->magic != SNAPSHOT_MAGIC || h->size > size || page < 0 || page >= h->pages)
+		return NULL;
+	if (h->pixel_offset + (uint64_t)h->width * h->height * (page + 1) > h->size)
+		return NULL;
+	return (const char *)snapshot + h->pixel_offset + (size_t)h->width * h->height * page;
+}
+
+uint64_t
+dfont_fingerprint(const void *key, size_t sz, uint64_t seed) {
+	// FNV-1a
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+// shared : the dfont block, then the mirror at the next 64 bytes
+static size_t
+shared_mirror_offset(int width, int height, int max_page) {
+	return (dfont_data_size(width, height, max_page) + 63) & ~(size_t)63;
+}
+
+size_t
+dfont_shared_size(int width, int height, int max_page) {
+	if (max_page < 1)
+		max_page = 1;
+	return shared_mirror_offset(width, height, max_page) + (size_t)width * height * max_page;
+}
+
+struct dfont *
+dfont_shared_init(void *block, int width, int height, int max_page) {
+	struct dfont *df = (struct dfont *)block;
+	if (max_page < 1)
+		max_page = 1;
+	dfont_init(block, width, height, max_page);
+	df->concurrent = 1;
+	df->mirror = (uint8_t *)block + shared_mirror_offset(width, height, max_page);
+	memset(df->mirror, 0, dfont_mirror_size(df));
+	df->shared_size = dfont_shared_size(width, height, max_page);
+	__atomic_store_n(&df->shared_magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+	return df;
+}
+
+struct dfont *
+dfont_shared_attach(void *block, size_t size) {
+	struct dfont *df = (struct dfont *)block;
+	if (size < sizeof(*df) || __atomic_load_n(&df->shared_magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC)
+		return NULL;
+	if (df->shared_size > size || df->shared_size != dfont_shared_size(df->width, df->height, df->max_page))
+		return NULL;
+	return df;
+}
+
+int
+dfont_shared_owner(struct dfont *df) {
+	return df->owner;
+}
+
+void
+dfont_request(struct dfont *df, int c, int font, int edge) {
+	// a slot is overwritten when the owner is too slow, the reader asks again on its next miss
+	unsigned i = __atomic_fetch_add(&df->request_head, 1, __ATOMIC_ACQ_REL);
+	struct request_slot *r = &df->request[i % REQUEST_SIZE];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&r->key, pack_key(c, font, edge), __ATOMIC_RELAXED);
+	__atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+int
+dfont_requests(struct dfont *df, struct dfont_miss *miss, int max) {
+	int n = 0;
+	write_lock(df);
+	unsigned head = __atomic_load_n(&df->request_head, __ATOMIC_ACQUIRE);
+	unsigned i = df->request_tail;
+	if (head - i > REQUEST_SIZE)
+		i = head - REQUEST_SIZE;
+	for (;i!=head && n<max;i++) {
+		struct request_slot *r = &df->request[i % REQUEST_SIZE];
+		unsigned seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		uint64_t key = __atomic_load_n(&r->key, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != i + 1 || __atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq) {
+			// reserved and not written yet : wait for it on the next call, unless a newer lap overwrites it
+			if (seq == 0 || (int)(seq - (i + 1)) < 0)
+				break;
+			continue;
+		}
+		struct dfont_miss *m = &miss[n];
+		int j;
+		if (hash_probe(&df->hash, key, &m->slot) >= 0)
+			continue;
+		for (j=0;j<n;j++) {
+			if (pack_key(miss[j].c, miss[j].font, miss[j].edge) == key)
+				break;
+		}
+		if (j < n)
+			continue;
+		m->index = n;
+		m->c = key_c(key);
+		m->font = key_font(key);
+		m->edge = key_edge(key);
+		m->serial = df->hash.serial;
+		++n;
+	}
+	df->request_tail = i;
+	write_unlock(df);
+	return n;
+}
+
+static void
+dump_node(struct dfont *df, uint32_t n) {
+	uint64_t key = df->node_key[n];
+	const struct dfont_rect *r = &df->node_rect[n];
+	printf("(%d/%d : %d %d %d %d %d) ", key_c(key), key_font(key), r->page, r->x, r->y, r->w, r->h);
+}
+
+void 
+dfont_dump(struct dfont * df) {
+	printf("version = %d\n",df->version);
+	printf("By version : ");
+	uint32_t n;
+	int h, p;
+	for (h=0;h<=df->height;h++) {
+		for (p=0;p<LRU_CLASSES;p++) {
+			int version = -1;
+			uint32_t lru = lru_head(df, h, p);
+			if (link_empty(df->time_link, lru))
+				continue;
+			printf("\nheight %d priority %d", h, p);
+			link_for_each(n, df->time_link, lru) {
+				if (df->node_version[n] != version) {
+					version = df->node_version[n];
+					printf("\nversion %d : ", version);
+				}
+				dump_node(df, n);
+			}
+		}
+	}
+	printf("\n");
+	printf("By line : \n");
+	struct font_line *line;
+	int i;
+	for (i=0;i<df->page;i++) {
+		printf("page %d :\n", i);
+		list_for_each_entry(line, struct font_line, &df->pages[i].order, order) {
+			if (line->free) {
+				printf("free (y=%d h=%d)\n",line->start_line, line->height);
+				continue;
+			}
+			printf("line (y=%d h=%d space=%d) :",line->start_line, line->height,line->space);
+			link_for_each(n, df->char_link, line_head(df, line)) {
+				const struct dfont_rect *r = &df->node_rect[n];
+				printf("%d(%d-%d) ",key_c(df->node_key[n]),r->x,r->x+r->w-1);
+			}
 			printf("\n");
 		}
 	}
+	printf("By hash : \n");
+	for (i=0;i<df->hash.cap;i++) {
+		if (df->hash.ctrl[i] & CTRL_EMPTY)
+			continue;
+		printf("%d : ",i);
+		dump_node(df, df->hash.index[i]);
+		printf("\n");
+	}
 }
@@ -1,6 +1,8 @@
 #ifndef dynamic_font_h
 #define dynamic_font_h
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
 
 struct dfont;
 
@@ -9,17 +11,156 @@ struct dfont_rect {
 	int y;
 	int w;
 	int h;
+	int page;
+};
+
+// a char not found by dfont_lookup_many, with a hint of the hash slot for its insert
+struct dfont_miss {
+	int index;
+	int c;
+	int font;
+	int edge;
+	int slot;
+	int serial;
+};
+
+// src is where the glyph was before dfont_compact, read every src from the page as it was before the call
+struct dfont_move {
+	struct dfont_rect src;
+	struct dfont_rect dst;
+};
+
+struct dfont_stats {
+	// counters since the dfont is created
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t insert;
+	uint64_t failed;	// no room even after evicting
+	uint64_t evict_lru;	// the oldest glyph of the same height gave its place
+	uint64_t evict_line;	// a whole line of another height was unused
+	uint64_t evict_page;	// dfont_evict_page
+	// the atlas right now
+	int pages;
+	int lines;	// the lines holding glyphs
+	int rects;
+	int working_set;	// rects used since the last dfont_flush
+	uint64_t pixels;	// area of the rects
+	uint64_t class_waste;	// area between the rects and the top of their line, see dfont_height_class
+	uint64_t line_pixels;	// area of the lines holding them
+	uint64_t total_pixels;	// area of the opened pages
+	uint64_t working_pixels;
+	float fragmentation;	// 1 - largest hole / free width, the mean of the lines with free space
+};
+
+struct dfont_line_stats {
+	int page;
+	int y;
+	int height;
+	int rects;
+	int used;	// width taken by the rects
+	int hole;	// the widest free run
 };
 
 struct dfont * dfont_create(int width, int height);
+struct dfont * dfont_create_pages(int width, int height, int max_page);
+// the nodes and lines are sized for pages full of min_size*min_size glyphs, 12 pixels for the two above. return NULL when out of memory
+struct dfont * dfont_create_min(int width, int height, int max_page, int min_size);
+// glyphs share the lines of their height class : the height rounded up to a multiple of step,
+// and when growth > 0, to buckets growing by at least growth percent. the default is exact heights (1, 0).
+// the rects keep the glyph height, and the lines already there keep theirs until they are evicted
+void dfont_height_class(struct dfont *, int step, int growth);
 void dfont_release(struct dfont *);
 const struct dfont_rect * dfont_lookup(struct dfont *, int c, int font, int edge);
 const struct dfont_rect * dfont_insert(struct dfont *, int c, int font, int width, int height, int edge);
+int dfont_lookup_many(struct dfont *, const int *c, int n, int font, int edge, const struct dfont_rect **rect, struct dfont_miss *miss);
+const struct dfont_rect * dfont_insert_miss(struct dfont *, const struct dfont_miss *miss, int width, int height);
 void dfont_remove(struct dfont *, int c, int font, int edge);
+// dfont_remove lets the rect go when its room is needed, dfont_erase gives the room back at once
+void dfont_erase(struct dfont *, int c, int font, int edge);
 void dfont_flush(struct dfont *);
+int dfont_pages(struct dfont *);
+int dfont_evict_page(struct dfont *, int page);
+// return the number of moves, nothing is done when it is more than max_moves. -1 when the page can't be repacked
+int dfont_compact(struct dfont *, int page, struct dfont_move *moves, int max_moves);
+void dfont_stats(struct dfont *, struct dfont_stats *stats);
+// return the number of lines holding glyphs, only max_lines are filled
+int dfont_line_stats(struct dfont *, struct dfont_line_stats *lines, int max_lines);
 void dfont_dump(struct dfont *); // for debug
 
-size_t dfont_data_size(int width, int height);
-void dfont_init(void* d, int width, int height);
+// any 64 bit key instead of (c, font, edge), for rects that are not glyphs. (c, font, edge) is the key c << 32 | font << 8 | edge
+const struct dfont_rect * dfont_lookup_key(struct dfont *, uint64_t key);
+const struct dfont_rect * dfont_insert_key(struct dfont *, uint64_t key, int width, int height);
+void dfont_remove_key(struct dfont *, uint64_t key);
+void dfont_erase_key(struct dfont *, uint64_t key);
+
+// a glyph of priority p can be evicted once it is unused for 2^p flushes, the lower classes go first.
+// a new glyph is in class 0 and moves to class 1 once it is used on 16 frames, DFONT_PIN is only evicted by dfont_evict_page.
+// in concurrent mode the frames of dfont_lookup_rect and dfont_read are counted by the next call taking the lock, dfont_flush at the latest.
+// pin a charset right after dfont_create to keep it in the first lines of page 0. return 0 when the glyph is not in
+#define DFONT_PRIORITY 4
+#define DFONT_PIN DFONT_PRIORITY
+int dfont_priority(struct dfont *, int c, int font, int edge, int priority);
+int dfont_priority_key(struct dfont *, uint64_t key, int priority);
+
+// a CPU copy of the atlas, pixels is dfont_mirror_size bytes : the A8 pages one after another, width bytes a row.
+// dfont_write copies a glyph into the rect returned by dfont_insert or dfont_lookup,
+// dfont_flush_uploads then calls upload with the dirty regions merged by line, pitch is the row length of pixels
+typedef void (*dfont_upload)(void *ud, int page, int x, int y, int w, int h, const void *pixels, int pitch);
+size_t dfont_mirror_size(struct dfont *);
+void dfont_mirror(struct dfont *, void *pixels);
+int dfont_write(struct dfont *, const struct dfont_rect *rect, const void *src, int pitch);
+// or the rasterizer draws it in place : dfont_write_rect returns the rect in the mirror and its pitch, NULL without a mirror,
+// and dfont_write_done marks it written as dfont_write does
+void * dfont_write_rect(struct dfont *, const struct dfont_rect *rect, int *pitch);
+int dfont_write_done(struct dfont *, const struct dfont_rect *rect);
+int dfont_flush_uploads(struct dfont *, dfont_upload upload, void *ud);
+
+// record every call to a binary trace, for the replay tool. NULL stops
+#define DFONT_TRACE_MAGIC 0x31544644	// "DFT1"
+#define DFONT_TRACE_ARGS 5
+#define DFONT_TRACE_LOOKUP 1	// c, font, edge
+#define DFONT_TRACE_INSERT 2	// c, font, width, height, edge
+#define DFONT_TRACE_REMOVE 3	// c, font, edge
+#define DFONT_TRACE_FLUSH 4	// 0
+#define DFONT_TRACE_EVICT_PAGE 5	// page
+#define DFONT_TRACE_COMPACT 6	// page, max_moves
+#define DFONT_TRACE_HEIGHT_CLASS 7	// step, growth
+#define DFONT_TRACE_PRIORITY 8	// c, font, edge, priority
+#define DFONT_TRACE_ERASE 9	// c, font, edge
+void dfont_trace(struct dfont *, FILE *f);
+
+// a position independent snapshot of the index and the A8 pixels of every page, it can be written to a file and mapped back.
+// pixels[page] is width*height bytes, or NULL to take them from the mirror. the fingerprint identifies the font and size the glyphs were rasterized with
+uint64_t dfont_fingerprint(const void *key, size_t sz, uint64_t seed);
+size_t dfont_snapshot_size(struct dfont *);
+size_t dfont_snapshot(struct dfont *, uint64_t fingerprint, const void * const *pixels, void *buffer, size_t size);
+// upload the pixels of each page at once after it. return 0 when the snapshot doesn't match the fingerprint or the size,
+// the dfont is left as it was then, or empty when the snapshot is corrupt
+int dfont_restore(struct dfont *, uint64_t fingerprint, const void *snapshot, size_t size);
+const void * dfont_snapshot_pixels(const void *snapshot, size_t size, int page);
+
+// share the dfont between threads : the calls above are serialized by an internal lock,
+// and the rect pointers they return are only stable until the next insert from any thread
+void dfont_concurrent(struct dfont *, int enable);
+// copy the rect out without taking the lock, it can be called from any thread. return 0 when not found
+int dfont_lookup_rect(struct dfont *, int c, int font, int edge, struct dfont_rect *rect);
+
+// share the dfont and its mirror between processes : block is dfont_shared_size bytes of shared memory, the mirror at its end.
+// the process calling dfont_shared_init owns it and may call everything above,
+// the ones attaching the block at any address only call dfont_lookup_rect, dfont_read and dfont_request
+size_t dfont_shared_size(int width, int height, int max_page);
+struct dfont * dfont_shared_init(void *block, int width, int height, int max_page);
+// return NULL until the owner has finished dfont_shared_init, or when the block is not a shared dfont
+struct dfont * dfont_shared_attach(void *block, size_t size);
+// the process id of the owner, to tell a block left by an owner that died from a live one
+int dfont_shared_owner(struct dfont *);
+// dfont_lookup_rect and copy the glyph pixels from the mirror to dst. return 0 when not found or not written yet
+int dfont_read(struct dfont *, int c, int font, int edge, struct dfont_rect *rect, void *dst, int pitch);
+// ask the owner for a glyph, dfont_requests returns the ones still missing, ready for dfont_insert_miss
+void dfont_request(struct dfont *, int c, int font, int edge);
+int dfont_requests(struct dfont *, struct dfont_miss *miss, int max);
+
+size_t dfont_data_size(int width, int height, int max_page);
+void dfont_init(void* d, int width, int height, int max_page);
 
 #endif
@@ -6,13 +6,43 @@ struct font_context {
 	int ascent;
 	void * font;
 	void * dc;
+	void * scratch;	// where the backend rasterizes before the copy to the cell, if it needs to
+	int scratch_size;
+	void * metrics;	// the cache of font_metrics, NULL until the first char is measured
 //    int edge;
 };
 
+// in pixels. the black box is x, y from the origin on the baseline, y down
+struct glyph_metrics {
+	short advance;
+	short x;	// the left bearing
+	short y;
+	short w;
+	short h;
+};
+
+// the cell of a glyph is its advance + 1 wide and the line height high, the glyph is drawn on the baseline ctx->ascent.
+// font_render sizes the cell of unicode in ctx->w and ctx->h, and when it is at most size bytes clears it
+// and draws the glyph in buffer, ctx->w bytes a row, all in one call. return the size of the cell
+int font_render(int unicode, struct font_context * ctx, void * buffer, int size);
+// font_size then font_glyph do the same in two calls
 void font_size(const char *str, int unicode, struct font_context * ctx);
 void font_glyph(const char * str, int unicode, void * buffer, struct font_context * ctx);
-void font_create(int font_size, struct font_context *ctx);
+// font_draw sizes the cell as font_size does, then clears it and draws the glyph at dst, pitch bytes a row.
+// size it with font_size first to draw straight into an atlas
+void font_draw(int unicode, struct font_context * ctx, void * dst, int pitch);
+// name is a face name for GDI (winfont.c), NULL for the default, or a font file for stb_truetype (stbfont.c), required. return 0 on failure
+int font_create(const char *name, int font_size, struct font_context *ctx);
 void font_release(struct font_context *ctx);
 
+// the metrics of unicode (>= 0) from the system, font_metrics caches them. the backend implements it
+void font_measure(int unicode, struct font_context *ctx, struct glyph_metrics *m);
+// metrics.c : the metrics of unicode, measured on the first call only. font_size reads them
+const struct glyph_metrics * font_metrics(int unicode, struct font_context *ctx);
+// measure n chars at once, before the text using them is laid out
+void font_metrics_prewarm(const int *unicode, int n, struct font_context *ctx);
+// font_release calls it
+void font_metrics_release(struct font_context *ctx);
+
 
 #endif
@@ -0,0 +1,427 @@
+#include "glyphpool.h"
+#include "font.h"
+#include "sdf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+typedef HANDLE thread_t;
+
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void)(c))
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_signal(c) WakeConditionVariable(c)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+typedef pthread_t thread_t;
+
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_signal(c) pthread_cond_signal(c)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+#endif
+
+#define MAX_FONT 16
+#define MAX_THREAD 16
+#define MAX_JOB 4096
+#define HASH_SIZE (MAX_JOB * 2)
+
+// a requested glyph, owned by the worker rasterizing it between the todo and the done queues
+struct job {
+	int font;
+	int c;
+	int fontkey;
+	int edge;
+	int w;
+	int h;
+	unsigned char *pixels;
+	int next;	// the freelist
+};
+
+struct pool_font {
+	char *name;
+	int size;
+	int spread;	// the glyphs are distance fields when it is not 0
+	struct font_context ctx;	// for glyph_pool_size on the render thread
+};
+
+struct worker {
+	struct glyph_pool *pool;
+	thread_t thread;
+	struct font_context ctx[MAX_FONT];
+	int created[MAX_FONT];	// 1 when ctx is created, -1 when font_create failed
+	unsigned char *scratch;
+	int scratch_size;
+	void *field;	// the scratch of sdf_build
+	size_t field_size;
+};
+
+struct glyph_pool {
+	mutex_t lock;
+	cond_t wake;
+	cond_t finish;	// a glyph is done
+	int quit;
+	int nfont;
+	int threads;
+	int pending;
+	int free_job;
+	// the jobs to rasterize and the jobs done, both in request order
+	unsigned todo_head;
+	unsigned todo_tail;
+	unsigned done_head;
+	unsigned done_tail;
+	int todo[MAX_JOB];
+	int done[MAX_JOB];
+	int hash[HASH_SIZE];	// job + 1 of each pending glyph, 0 is empty
+	struct job job[MAX_JOB];
+	struct pool_font font[MAX_FONT];
+	struct worker worker[MAX_THREAD];
+};
+
+static inline int
+job_hash(int font, int c, int fontkey, int edge) {
+	uint32_t h = (uint32_t)c * 2654435761u;
+	h ^= ((uint32_t)fontkey << 8 | (uint32_t)edge) * 2246822519u;
+	h ^= (uint32_t)font * 3266489917u;
+	return (h ^ h >> 15) & (HASH_SIZE - 1);
+}
+
+static int
+hash_find(struct glyph_pool *p, int font, int c, int fontkey, int edge) {
+	int slot = job_hash(font, c, fontkey, edge);
+	while (p->hash[slot]) {
+		const struct job *j = &p->job[p->hash[slot] - 1];
+		if (j->c == c && j->font == font && j->fontkey == fontkey && j->edge == edge)
+			break;
+		slot = (slot + 1) & (HASH_SIZE - 1);
+	}
+	return slot;
+}
+
+// linear probing, the entries after the hole are shifted back so nothing is lost behind it
+static void
+hash_remove(struct glyph_pool *p, int slot) {
+	int next = slot;
+	for (;;) {
+		p->hash[slot] = 0;
+		for (;;) {
+			next = (next + 1) & (HASH_SIZE - 1);
+			if (p->hash[next] == 0)
+				return;
+			const struct job *j = &p->job[p->hash[next] - 1];
+			int home = job_hash(j->font, j->c, j->fontkey, j->edge);
+			// it can go back to slot when its home isn't in (slot, next]
+			if (((next - home) & (HASH_SIZE - 1)) >= ((next - slot) & (HASH_SIZE - 1)))
+				break;
+		}
+		p->hash[slot] = p->hash[next];
+		slot = next;
+	}
+}
+
+static void
+rasterize(struct worker *w, struct job *j, const struct pool_font *f) {
+	struct font_context *ctx = &w->ctx[j->font];
+	j->w = 0;
+	j->h = 0;
+	j->pixels = NULL;
+	if (w->created[j->font] == 0)
+		w->created[j->font] = font_create(f->name, f->size, ctx) ? 1 : -1;
+	if (w->created[j->font] < 0)
+		return;
+	int size = font_render(j->c, ctx, w->scratch, w->scratch_size);
+	if (size > w->scratch_size) {
+		free(w->scratch);
+		w->scratch = (unsigned char *)malloc(size);
+		w->scratch_size = size;
+		font_render(j->c, ctx, w->scratch, size);
+	}
+	if (f->spread == 0) {
+		j->pixels = (unsigned char *)malloc(size);
+		memcpy(j->pixels, w->scratch, size);
+		j->w = ctx->w;
+		j->h = ctx->h;
+		return;
+	}
+	size_t field = sdf_scratch_size(ctx->w, ctx->h, f->spread);
+	if (field > w->field_size) {
+		free(w->field);
+		w->field = malloc(field);
+		w->field_size = field;
+	}
+	j->w = ctx->w + 2 * f->spread;
+	j->h = ctx->h + 2 * f->spread;
+	j->pixels = (unsigned char *)malloc(j->w * j->h);
+	sdf_build(w->scratch, ctx->w, ctx->h, f->spread, j->pixels, w->field);
+}
+
+static void
+work(struct worker *w) {
+	struct glyph_pool *p = w->pool;
+	int i;
+	mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->quit && p->todo_head == p->todo_tail)
+			cond_wait(&p->wake, &p->lock);
+		if (p->quit)
+			break;
+		int index = p->todo[p->todo_head++ % MAX_JOB];
+		struct job *j = &p->job[index];
+		const struct pool_font *f = &p->font[j->font];
+		mutex_unlock(&p->lock);
+		rasterize(w, j, f);
+		mutex_lock(&p->lock);
+		p->done[p->done_tail++ % MAX_JOB] = index;
+		cond_signal(&p->finish);
+	}
+	mutex_unlock(&p->lock);
+	// the font contexts are released by the thread that created them, GDI wants it so
+	for (i=0;i<MAX_FONT;i++) {
+		if (w->created[i] > 0)
+			font_release(&w->ctx[i]);
+	}
+	free(w->scratch);
+	free(w->field);
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI
+worker_main(LPVOID ud) {
+	work((struct worker *)ud);
+	return 0;
+}
+
+static int
+thread_start(struct worker *w) {
+	w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+	return w->thread != NULL;
+}
+
+static void
+thread_join(struct worker *w) {
+	WaitForSingleObject(w->thread, INFINITE);
+	CloseHandle(w->thread);
+}
+
+#else
+
+static void *
+worker_main(void *ud) {
+	work((struct worker *)ud);
+	return NULL;
+}
+
+static int
+thread_start(struct worker *w) {
+	return pthread_create(&w->thread, NULL, worker_main, w) == 0;
+}
+
+static void
+thread_join(struct worker *w) {
+	pthread_join(w->thread, NULL);
+}
+
+#endif
+
+struct glyph_pool *
+glyph_pool_create(int threads) {
+	struct glyph_pool *p = (struct glyph_pool *)malloc(sizeof(*p));
+	int i;
+	if (p == NULL)
+		return NULL;
+	if (threads < 1)
+		threads = 1;
+	else if (threads > MAX_THREAD)
+		threads = MAX_THREAD;
+	memset(p, 0, sizeof(*p));
+	mutex_init(&p->lock);
+	cond_init(&p->wake);
+	cond_init(&p->finish);
+	for (i=0;i<MAX_JOB;i++) {
+		p->job[i].next = i + 1;
+	}
+	p->job[MAX_JOB-1].next = -1;
+	p->free_job = 0;
+	for (i=0;i<threads;i++) {
+		struct worker *w = &p->worker[p->threads];
+		w->pool = p;
+		if (thread_start(w))
+			++p->threads;
+	}
+	if (p->threads == 0) {
+		// nothing would ever take the requests
+		cond_destroy(&p->wake);
+		cond_destroy(&p->finish);
+		mutex_destroy(&p->lock);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void
+glyph_pool_release(struct glyph_pool *p) {
+	int i;
+	mutex_lock(&p->lock);
+	p->quit = 1;
+	cond_broadcast(&p->wake);
+	mutex_unlock(&p->lock);
+	for (i=0;i<p->threads;i++) {
+		thread_join(&p->worker[i]);
+	}
+	while (p->done_head != p->done_tail) {
+		free(p->job[p->done[p->done_head++ % MAX_JOB]].pixels);
+	}
+	for (i=0;i<p->nfont;i++) {
+		font_release(&p->font[i].ctx);
+		free(p->font[i].name);
+	}
+	cond_destroy(&p->wake);
+	cond_destroy(&p->finish);
+	mutex_destroy(&p->lock);
+	free(p);
+}
+
+int
+glyph_pool_font(struct glyph_pool *p, const char *name, int size, int spread) {
+	if (p->nfont >= MAX_FONT || spread < 0 || spread > SDF_MAX_SPREAD)
+		return -1;
+	struct pool_font *f = &p->font[p->nfont];
+	if (!font_create(name, size, &f->ctx))
+		return -1;
+	f->name = name ? strdup(name) : NULL;
+	f->size = size;
+	f->spread = spread;
+	// the workers read the fonts below nfont without the lock
+	mutex_lock(&p->lock);
+	int id = p->nfont++;
+	mutex_unlock(&p->lock);
+	return id;
+}
+
+void
+glyph_pool_size(struct glyph_pool *p, int font, int c, int *w, int *h) {
+	struct pool_font *f = &p->font[font];
+	font_size(NULL, c, &f->ctx);
+	*w = f->ctx.w + 2 * f->spread;
+	*h = f->ctx.h + 2 * f->spread;
+}
+
+void
+glyph_pool_metrics(struct glyph_pool *p, int font, const int *codes, int n) {
+	font_metrics_prewarm(codes, n, &p->font[font].ctx);
+}
+
+int
+glyph_pool_spread(struct glyph_pool *p, int font) {
+	if (font < 0 || font >= p->nfont)
+		return -1;
+	return p->font[font].spread;
+}
+
+int
+glyph_pool_request(struct glyph_pool *p, int font, int c, int fontkey, int edge) {
+	if (font < 0 || font >= p->nfont)
+		return -1;
+	mutex_lock(&p->lock);
+	int slot = hash_find(p, font, c, fontkey, edge);
+	if (p->hash[slot]) {
+		mutex_unlock(&p->lock);
+		return 0;
+	}
+	int index = p->free_job;
+	if (index < 0) {
+		mutex_unlock(&p->lock);
+		return -1;
+	}
+	struct job *j = &p->job[index];
+	p->free_job = j->next;
+	j->font = font;
+	j->c = c;
+	j->fontkey = fontkey;
+	j->edge = edge;
+	p->hash[slot] = index + 1;
+	p->todo[p->todo_tail++ % MAX_JOB] = index;
+	++p->pending;
+	cond_signal(&p->wake);
+	mutex_unlock(&p->lock);
+	return 1;
+}
+
+static int
+take_done(struct glyph_pool *p, struct glyph_bitmap *out, int max) {
+	int n = 0;
+	while (n < max && p->done_head != p->done_tail) {
+		int index = p->done[p->done_head++ % MAX_JOB];
+		struct job *j = &p->job[index];
+		struct glyph_bitmap *g = &out[n++];
+		g->font = j->font;
+		g->c = j->c;
+		g->fontkey = j->fontkey;
+		g->edge = j->edge;
+		g->w = j->w;
+		g->h = j->h;
+		g->pixels = j->pixels;
+		hash_remove(p, hash_find(p, j->font, j->c, j->fontkey, j->edge));
+		j->next = p->free_job;
+		p->free_job = index;
+		--p->pending;
+	}
+	return n;
+}
+
+int
+glyph_pool_done(struct glyph_pool *p, struct glyph_bitmap *out, int max) {
+	mutex_lock(&p->lock);
+	int n = take_done(p, out, max);
+	mutex_unlock(&p->lock);
+	return n;
+}
+
+int
+glyph_pool_wait(struct glyph_pool *p, struct glyph_bitmap *out, int max) {
+	mutex_lock(&p->lock);
+	while (p->threads > 0 && p->pending > 0 && p->done_head == p->done_tail)
+		cond_wait(&p->finish, &p->lock);
+	int n = take_done(p, out, max);
+	mutex_unlock(&p->lock);
+	return n;
+}
+
+void
+glyph_pool_free(struct glyph_bitmap *g, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		free(g[i].pixels);
+		g[i].pixels = NULL;
+	}
+}
+
+int
+glyph_pool_pending(struct glyph_pool *p) {
+	mutex_lock(&p->lock);
+	int n = p->pending;
+	mutex_unlock(&p->lock);
+	return n;
+}
@@ -0,0 +1,41 @@
+#ifndef glyph_pool_h
+#define glyph_pool_h
+
+// worker threads rasterizing glyphs off the render thread.
+// the render thread requests the glyphs it misses, and later takes the finished bitmaps with glyph_pool_done
+// to insert them into the dfont. every call but the workers' own is from the render thread
+struct glyph_pool;
+
+struct glyph_bitmap {
+	int font;	// the id of glyph_pool_font
+	int c;
+	int fontkey;	// the dfont key it was requested with
+	int edge;
+	int w;
+	int h;
+	unsigned char *pixels;	// w * h, free it with glyph_pool_free
+};
+
+// return NULL when no worker thread can be started
+struct glyph_pool * glyph_pool_create(int threads);
+void glyph_pool_release(struct glyph_pool *);
+// each worker creates its own font_context of (name, size) on first use, see font_create.
+// the glyphs of a font with a spread are the distance fields of sdf_build. return the font id, -1 on failure
+int glyph_pool_font(struct glyph_pool *, const char *name, int size, int spread);
+// the cell of c, from a font_context of the render thread, to lay out a glyph not rasterized yet
+void glyph_pool_size(struct glyph_pool *, int font, int c, int *w, int *h);
+// measure n chars at once in the font_context of glyph_pool_size, see font_metrics_prewarm
+void glyph_pool_metrics(struct glyph_pool *, int font, const int *codes, int n);
+// -1 when font is not an id of glyph_pool_font
+int glyph_pool_spread(struct glyph_pool *, int font);
+// return 1 when queued, 0 when it is queued already, -1 when the queue is full
+int glyph_pool_request(struct glyph_pool *, int font, int c, int fontkey, int edge);
+// take at most max finished glyphs
+int glyph_pool_done(struct glyph_pool *, struct glyph_bitmap *out, int max);
+// as glyph_pool_done, but block until a glyph is finished. return 0 only when nothing is pending
+int glyph_pool_wait(struct glyph_pool *, struct glyph_bitmap *out, int max);
+void glyph_pool_free(struct glyph_bitmap *g, int n);
+// the glyphs requested and not taken yet
+int glyph_pool_pending(struct glyph_pool *);
+
+#endif
@@ -0,0 +1,243 @@
+#include "layout.h"
+#include <stdlib.h>
+#include <string.h>
+
+void
+text_buffer_init(struct text_buffer *b, float xscale, float yscale, float uscale, float vscale) {
+	b->v = NULL;
+	b->n = 0;
+	b->cap = 0;
+	b->xscale = xscale;
+	b->yscale = yscale;
+	b->uscale = uscale;
+	b->vscale = vscale;
+}
+
+void
+text_buffer_clear(struct text_buffer *b) {
+	b->n = 0;
+}
+
+void
+text_buffer_release(struct text_buffer *b) {
+	free(b->v);
+	b->v = NULL;
+	b->n = 0;
+	b->cap = 0;
+}
+
+static inline void
+vertex(struct text_vertex *v, const struct text_buffer *b, float x, float y, int u, int t, int page, const float color[4]) {
+	v->x = x * b->xscale;
+	v->y = y * b->yscale;
+	v->u = u * b->uscale;
+	v->v = t * b->vscale;
+	v->r = color[0];
+	v->g = color[1];
+	v->b = color[2];
+	v->a = color[3];
+	v->layer = (float)page;
+}
+
+// room for n more quads
+static void
+reserve(struct text_buffer *b, int n) {
+	if (b->n + n > b->cap) {
+		b->cap = b->cap * 2 + 64;
+		if (b->cap < b->n + n)
+			b->cap = b->n + n;
+		b->v = (struct text_vertex *)realloc(b->v, b->cap * 4 * sizeof(*b->v));
+	}
+}
+
+static void
+quad(struct text_buffer *b, float x, float y, float scale, const struct dfont_rect *r, const float color[4]) {
+	reserve(b, 1);
+	struct text_vertex *v = b->v + b->n * 4;
+	float w = r->w * scale;
+	float h = r->h * scale;
+	vertex(&v[0], b, x, y, r->x, r->y, r->page, color);
+	vertex(&v[1], b, x + w, y, r->x + r->w, r->y, r->page, color);
+	vertex(&v[2], b, x + w, y + h, r->x + r->w, r->y + r->h, r->page, color);
+	vertex(&v[3], b, x, y + h, r->x, r->y + r->h, r->page, color);
+	++b->n;
+}
+
+// move the quads from first by dx, dy pixels
+static void
+shift(struct text_buffer *b, int first, float dx, float dy) {
+	int i;
+	dx *= b->xscale;
+	dy *= b->yscale;
+	for (i=first*4;i<b->n*4;i++) {
+		b->v[i].x += dx;
+		b->v[i].y += dy;
+	}
+}
+
+// the scripts written without spaces, a line can break on either side of their chars
+static inline int
+cjk(int c) {
+	return (c >= 0x2e80 && c < 0xa000) || (c >= 0xac00 && c < 0xd7b0) || (c >= 0xf900 && c < 0xfb00) || (c >= 0xff00 && c < 0xfff0);
+}
+
+static inline float
+max_height(float a, float b) {
+	return a > b ? a : b;
+}
+
+float
+text_layout(struct text_buffer *b, const int *codes, const struct dfont_rect * const *rect, int n, const struct text_style *s) {
+	float color[4] = {
+		(s->color >> 24) / 255.0f,
+		((s->color >> 16) & 0xff) / 255.0f,
+		((s->color >> 8) & 0xff) / 255.0f,
+		(s->color & 0xff) / 255.0f,
+	};
+	float left = s->x;
+	float x = left;
+	float y = s->y;
+	float pad = s->pad * s->scale;
+	// the glyphs after the last break go to the next line when the line is too long,
+	// line_h is the tallest glyph before the break and tail_h the tallest after
+	float line_h = 0;
+	float tail_h = 0;
+	float last_h = 0;
+	float brk_x = left;
+	int brk_quad = b->n;
+	int i;
+	for (i=0;i<n;i++) {
+		int c = codes[i];
+		if (c == '\n') {
+			float h = max_height(line_h, tail_h);
+			if (h == 0)
+				h = last_h;
+			y += h;
+			last_h = h;
+			x = left;
+			line_h = tail_h = 0;
+			brk_x = left;
+			brk_quad = b->n;
+			continue;
+		}
+		const struct dfont_rect *r = rect[i];
+		float advance = (r->w - 2 * s->pad) * s->scale;
+		float height = (r->h - 2 * s->pad) * s->scale;
+		if (cjk(c)) {
+			line_h = max_height(line_h, tail_h);
+			tail_h = 0;
+			brk_x = x;
+			brk_quad = b->n;
+		}
+		if (s->wrap > 0 && x > left && x + advance > left + s->wrap && c != ' ') {
+			if (brk_x > left) {
+				// the word goes to the next line
+				shift(b, brk_quad, left - brk_x, line_h);
+				x += left - brk_x;
+				y += line_h;
+				last_h = line_h;
+				line_h = 0;
+			} else {
+				// a word longer than the line breaks at the char
+				float h = max_height(line_h, tail_h);
+				y += h;
+				last_h = h;
+				x = left;
+				line_h = tail_h = 0;
+				brk_quad = b->n;
+			}
+			brk_x = left;
+		}
+		if (r->x >= 0 && c != ' ')
+			quad(b, x - pad, y - pad, s->scale, r, color);
+		tail_h = max_height(tail_h, height);
+		x += advance;
+		if (c == ' ' || cjk(c)) {
+			line_h = max_height(line_h, tail_h);
+			tail_h = 0;
+			brk_x = x;
+			brk_quad = b->n;
+		}
+	}
+	return y + max_height(line_h, tail_h) - s->y;
+}
+
+void
+text_run_init(struct text_run *r) {
+	text_buffer_init(&r->b, 0, 0, 0, 0);
+	r->codes = NULL;
+	r->rect = NULL;
+	r->n = 0;
+	r->cap = 0;
+	r->font = 0;
+	r->edge = 0;
+	r->height = 0;
+	memset(&r->style, 0, sizeof(r->style));
+}
+
+void
+text_run_release(struct text_run *r) {
+	text_buffer_release(&r->b);
+	free(r->codes);
+	free(r->rect);
+	text_run_init(r);
+}
+
+int
+text_run_match(const struct text_run *r, const struct text_buffer *b, const int *codes, int n, int font, int edge, const struct text_style *s) {
+	const struct text_style *rs = &r->style;
+	return r->n == n && r->font == font && r->edge == edge
+		&& rs->x == s->x && rs->y == s->y && rs->scale == s->scale && rs->wrap == s->wrap
+		&& rs->pad == s->pad && rs->color == s->color
+		&& r->b.xscale == b->xscale && r->b.yscale == b->yscale
+		&& r->b.uscale == b->uscale && r->b.vscale == b->vscale
+		&& (n == 0 || memcmp(r->codes, codes, n * sizeof(int)) == 0);
+}
+
+int
+text_run_valid(const struct text_run *r, const struct dfont_rect * const *rect) {
+	int i;
+	for (i=0;i<r->n;i++) {
+		const struct dfont_rect *a = &r->rect[i];
+		const struct dfont_rect *b = rect[i];
+		if (b == NULL || a->x != b->x || a->y != b->y || a->w != b->w || a->h != b->h || a->page != b->page)
+			return 0;
+	}
+	return 1;
+}
+
+float
+text_run_layout(struct text_run *r, const struct text_buffer *b, const int *codes, const struct dfont_rect * const *rect, int n, int font, int edge, const struct text_style *s) {
+	int i;
+	if (n > r->cap) {
+		r->cap = n;
+		r->codes = (int *)realloc(r->codes, n * sizeof(int));
+		r->rect = (struct dfont_rect *)realloc(r->rect, n * sizeof(struct dfont_rect));
+	}
+	// n may be 0 and codes NULL
+	if (n > 0)
+		memcpy(r->codes, codes, n * sizeof(int));
+	for (i=0;i<n;i++) {
+		r->rect[i] = *rect[i];
+	}
+	r->n = n;
+	r->font = font;
+	r->edge = edge;
+	r->style = *s;
+	r->b.xscale = b->xscale;
+	r->b.yscale = b->yscale;
+	r->b.uscale = b->uscale;
+	r->b.vscale = b->vscale;
+	text_buffer_clear(&r->b);
+	r->height = text_layout(&r->b, codes, rect, n, s);
+	return r->height;
+}
+
+void
+text_buffer_append(struct text_buffer *b, const struct text_run *r) {
+	if (r->b.n == 0)
+		return;
+	reserve(b, r->b.n);
+	memcpy(b->v + b->n * 4, r->b.v, r->b.n * 4 * sizeof(*b->v));
+	b->n += r->b.n;
+}
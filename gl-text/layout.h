@@ -0,0 +1,73 @@
+#ifndef text_layout_h
+#define text_layout_h
+#include <stdint.h>
+#include "dfont.h"
+
+// 4 vertices a glyph in the order top left, top right, bottom right, bottom left, ready for glBufferData.
+// layer is the atlas page of the glyph, the layer of a texture array when the dfont has more than one page
+struct text_vertex {
+	float x;
+	float y;
+	float u;
+	float v;
+	float r;
+	float g;
+	float b;
+	float a;
+	float layer;
+};
+
+struct text_buffer {
+	struct text_vertex *v;
+	int n;	// quads
+	int cap;
+	// from pixels to the vertex space and to the texture space, every page of the atlas has the same size
+	float xscale;
+	float yscale;
+	float uscale;
+	float vscale;
+};
+
+struct text_style {
+	float x;	// the top left of the first line, in pixels
+	float y;
+	float scale;	// the drawn size over the size the glyphs were rasterized at
+	float wrap;	// break the lines longer than it, 0 doesn't
+	int pad;	// the rects are pad pixels larger than the glyph on every side, the spread of a distance field
+	uint32_t color;	// 0xRRGGBBAA
+};
+
+void text_buffer_init(struct text_buffer *b, float xscale, float yscale, float uscale, float vscale);
+void text_buffer_clear(struct text_buffer *b);
+void text_buffer_release(struct text_buffer *b);
+// append the quads of n chars whose rects are looked up already. a rect with x < 0 is not drawn but keeps its place.
+// '\n' breaks the line, it needs no glyph and its rect is not read.
+// with a wrap the lines break after a space or around a CJK char, anywhere when there is none.
+// the line height is the tallest glyph in it. return the height of the text
+float text_layout(struct text_buffer *b, const int *codes, const struct dfont_rect * const *rect, int n, const struct text_style *s);
+
+// a text laid out once, its quads are appended again as long as the chars, the style and their rects are the same
+struct text_run {
+	struct text_buffer b;
+	int *codes;
+	struct dfont_rect *rect;	// the rects the quads were made from, x < 0 for the glyphs not drawn
+	int n;
+	int cap;
+	int font;	// the dfont key of the glyphs
+	int edge;
+	float height;
+	struct text_style style;
+};
+
+void text_run_init(struct text_run *r);
+void text_run_release(struct text_run *r);
+// 1 when the run was laid out from the same chars and style, for the same scales as b
+int text_run_match(const struct text_run *r, const struct text_buffer *b, const int *codes, int n, int font, int edge, const struct text_style *s);
+// 1 when every glyph is still at the rect the quads were made from
+int text_run_valid(const struct text_run *r, const struct dfont_rect * const *rect);
+// lay the chars out again into the run, with the scales of b. return the height of the text
+float text_run_layout(struct text_run *r, const struct text_buffer *b, const int *codes, const struct dfont_rect * const *rect, int n, int font, int edge, const struct text_style *s);
+// append the quads of the run to b with one copy
+void text_buffer_append(struct text_buffer *b, const struct text_run *r);
+
+#endif
@@ -1,20 +1,81 @@
 #include "font.h"
 #include "dfont.h"
+#include "sprite.h"
+#include "glyphpool.h"
+#include "sdf.h"
+#include "layout.h"
 #include <lua.h>
 #include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#endif
 
 #define DFONT_NAME "dfont"
 #define FONT_NAME "font"
+#define SNAPSHOT_NAME "dfont_snapshot"
+#define CLIENT_NAME "dfont_client"
+#define SPRITE_NAME "sprite_atlas"
+#define POOL_NAME "glyph_pool"
+#define TEXT_NAME "text_buffer"
+#define RUN_NAME "text_run"
+#define MAX_DONE 64
+#define SDF_SPREAD 4
+#define MAX_WARM_FONT 16
+#define MAX_STRING 1024
+#define MAX_CODEPOINT 0x10ffff
+#define MAX_CHARSET (MAX_CODEPOINT + 1)
 
 struct font_ud {
 	struct dfont *font;
+	int width;
+	int height;
+	void *mirror;
+	FILE *trace;
+	char *scratch;	// a glyph is rasterized here before dfont_write
+	int scratch_size;
+	char *sdf;	// the distance field of the glyph in scratch, then the scratch of sdf_build
+	size_t sdf_size;
+	void *shared;	// the shared memory of font.dfont_shared or font.dfont_attach, the dfont and the mirror are in it
+	size_t shared_size;
+	void *shared_handle;	// the file mapping, kept open by the owner on windows
+	char *shared_name;	// unlinked by the owner elsewhere
+};
+
+// a snapshot file mapped read only
+struct snapshot_ud {
+	const void *data;
+	size_t size;
 };
 
+static void shared_unmap(struct font_ud *ud);
+
 static int
 ldfont_release(lua_State *L){
 	struct font_ud *ud = lua_touserdata(L,1);
-	dfont_release(ud->font);
+	if(ud->shared){
+		shared_unmap(ud);
+	} else {
+		dfont_release(ud->font);
+		free(ud->mirror);
+	}
+	free(ud->scratch);
+	free(ud->sdf);
+	if(ud->trace){fclose(ud->trace);}
+	ud->trace = NULL;
 	ud->font = NULL;
+	ud->mirror = NULL;
+	ud->scratch = NULL;
+	ud->sdf = NULL;
 	return 0;
 }
 
@@ -31,7 +92,8 @@ ldfont_lookup(lua_State *L){
 		lua_pushinteger(L,rect->y);
 		lua_pushinteger(L,rect->w);
 		lua_pushinteger(L,rect->h);
-		return 4;
+		lua_pushinteger(L,rect->page);
+		return 5;
 	}
 }
 
@@ -50,8 +112,632 @@ ldfont_insert(lua_State *L){
 		lua_pushinteger(L,rect->y);
 		lua_pushinteger(L,rect->w);
 		lua_pushinteger(L,rect->h);
-		return 4;
+		lua_pushinteger(L,rect->page);
+		return 5;
+	}
+}
+
+static int
+utf8_decode(const char *s, size_t sz, int *codes, int max){
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *e = p + sz;
+	int n = 0;
+	while(p < e){
+		int c = *p++;
+		int more = 0;
+		if(c >= 0xf0){c &= 0x07; more = 3;}
+		else if(c >= 0xe0){c &= 0x0f; more = 2;}
+		else if(c >= 0xc0){c &= 0x1f; more = 1;}
+		else if(c >= 0x80){return -1;}
+		if(e - p < more){return -1;}
+		while(more--){
+			if((*p & 0xc0) != 0x80){return -1;}
+			c = (c << 6) | (*p++ & 0x3f);
+		}
+		if(c > MAX_CODEPOINT){return -1;}
+		if(n == max){return -1;}
+		codes[n++] = c;
+	}
+	return n;
+}
+
+static int
+check_codes(lua_State *L, int index, int *codes){
+	if(lua_type(L,index) == LUA_TTABLE){
+		int n = lua_rawlen(L,index);
+		int i;
+		luaL_argcheck(L,n <= MAX_STRING,index,"too many chars");
+		for(i = 0;i < n;i++){
+			lua_rawgeti(L,index,i+1);
+			luaL_argcheck(L,lua_isinteger(L,-1),index,"invalid codepoint");
+			lua_Integer c = lua_tointeger(L,-1);
+			luaL_argcheck(L,c >= 0 && c <= MAX_CODEPOINT,index,"invalid codepoint");
+			codes[i] = (int)c;
+			lua_pop(L,1);
+		}
+		return n;
+	}
+	size_t sz;
+	const char *str = luaL_checklstring(L,index,&sz);
+	int n = utf8_decode(str,sz,codes,MAX_STRING);
+	luaL_argcheck(L,n >= 0,index,"invalid utf8 string or too many chars");
+	return n;
+}
+
+// the glyph sized and drawn in ud->scratch with one call to the rasterizer. return its size, ctx->w * ctx->h
+static int
+rasterize(struct font_ud *ud, struct font_context *ctx, int c){
+	int size = font_render(c,ctx,ud->scratch,ud->scratch_size);
+	if(size > ud->scratch_size){
+		free(ud->scratch);
+		ud->scratch = malloc(size);
+		ud->scratch_size = size;
+		font_render(c,ctx,ud->scratch,size);
+	}
+	return size;
+}
+
+// {x,y,w,h,page,glyph} at the top of the stack
+static void
+push_glyph(lua_State *L, const struct dfont_rect *r, const void *pixels, int size){
+	lua_createtable(L,6,0);
+	lua_pushinteger(L,r->x);
+	lua_rawseti(L,-2,1);
+	lua_pushinteger(L,r->y);
+	lua_rawseti(L,-2,2);
+	lua_pushinteger(L,r->w);
+	lua_rawseti(L,-2,3);
+	lua_pushinteger(L,r->h);
+	lua_rawseti(L,-2,4);
+	lua_pushinteger(L,r->page);
+	lua_rawseti(L,-2,5);
+	lua_pushlstring(L,pixels,size);
+	lua_rawseti(L,-2,6);
+}
+
+// {x,y,w,h,page, ...} for every char at the top of the stack
+static void
+push_rects(lua_State *L, const struct dfont_rect **rect, int n){
+	int i;
+	lua_createtable(L,n*5,0);
+	for(i = 0;i < n;i++){
+		lua_pushinteger(L,rect[i]->x);
+		lua_rawseti(L,-2,i*5+1);
+		lua_pushinteger(L,rect[i]->y);
+		lua_rawseti(L,-2,i*5+2);
+		lua_pushinteger(L,rect[i]->w);
+		lua_rawseti(L,-2,i*5+3);
+		lua_pushinteger(L,rect[i]->h);
+		lua_rawseti(L,-2,i*5+4);
+		lua_pushinteger(L,rect[i]->page);
+		lua_rawseti(L,-2,i*5+5);
+	}
+}
+
+// the distance field of the glyph rasterize left in ud->scratch, (ctx->w + 2 * spread) * (ctx->h + 2 * spread) bytes
+static const char *
+distance_field(struct font_ud *ud, struct font_context *ctx, int spread){
+	// the floats of sdf_build after the field
+	size_t offset = ((size_t)(ctx->w + 2 * spread) * (ctx->h + 2 * spread) + 15) & ~(size_t)15;
+	size_t size = offset + sdf_scratch_size(ctx->w,ctx->h,spread);
+	if(size > ud->sdf_size){
+		free(ud->sdf);
+		ud->sdf = malloc(size);
+		ud->sdf_size = size;
+	}
+	sdf_build((const uint8_t *)ud->scratch,ctx->w,ctx->h,spread,(uint8_t *)ud->sdf,ud->sdf + offset);
+	return ud->sdf;
+}
+
+// look the chars up and rasterize the misses with ctx, a miss without room gets a rect in failed.
+// {{x,y,w,h,page,glyph}, ...} to upload is pushed
+static void
+resolve_glyphs(lua_State *L, struct font_ud *ud, struct font_context *ctx, const int *codes, int n, int font, int edge, int spread, const struct dfont_rect **rect, struct dfont_rect *failed){
+	struct dfont_miss miss[MAX_STRING];
+	int nmiss = dfont_lookup_many(ud->font,codes,n,font,edge,rect,miss);
+	int i,j,nupload = 0;
+	lua_createtable(L,nmiss,0);
+	for(i = 0;i < nmiss;i++){
+		struct dfont_miss *m = &miss[i];
+		for(j = 0;j < i;j++){
+			if(miss[j].c == m->c){break;}
+		}
+		if(j < i){
+			rect[m->index] = rect[miss[j].index];
+			continue;
+		}
+		// with a mirror a glyph is drawn straight into it once it has a rect, a distance field is built in the scratch first
+		int direct = ud->mirror && spread == 0;
+		int size = 0;
+		const char *pixels = NULL;
+		if(direct){
+			font_size(NULL,m->c,ctx);
+		} else {
+			size = rasterize(ud,ctx,m->c);
+			pixels = ud->scratch;
+		}
+		int w = ctx->w;
+		int h = ctx->h;
+		if(spread > 0){
+			pixels = distance_field(ud,ctx,spread);
+			w += 2 * spread;
+			h += 2 * spread;
+			size = w * h;
+		}
+		const struct dfont_rect *r = dfont_insert_miss(ud->font,m,w,h);
+		if(r == NULL){
+			struct dfont_rect *f = &failed[m->index];
+			f->x = -1;
+			f->y = -1;
+			f->page = -1;
+			f->w = w;
+			f->h = h;
+			rect[m->index] = f;
+			continue;
+		}
+		rect[m->index] = r;
+		if(direct){
+			int pitch;
+			font_draw(m->c,ctx,dfont_write_rect(ud->font,r,&pitch),pitch);
+			dfont_write_done(ud->font,r);
+			continue;
+		}
+		if(ud->mirror){
+			dfont_write(ud->font,r,pixels,w);
+			continue;
+		}
+		push_glyph(L,r,pixels,size);
+		lua_rawseti(L,-2,++nupload);
+	}
+}
+
+// the common part of lookup_many and lookup_sdf : the dfont at 1, the font at 2, the chars at 3
+static int
+lookup_glyphs(lua_State *L, int font, int edge, int spread){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct font_context *ctx = luaL_checkudata(L,2,FONT_NAME);
+	int codes[MAX_STRING];
+	const struct dfont_rect *rect[MAX_STRING];
+	struct dfont_rect failed[MAX_STRING];
+	int n = check_codes(L,3,codes);
+	resolve_glyphs(L,ud,ctx,codes,n,font,edge,spread,rect,failed);
+	push_rects(L,rect,n);
+	lua_insert(L,-2);
+	return 2;
+}
+
+/*
+ * dfont:lookup_many(font, str|codes, fontkey, edge)
+ * return {x,y,w,h,page, ...} for every char and {{x,y,w,h,page,glyph}, ...} for the chars to upload.
+ * a char that can't be inserted gets x = y = page = -1 and keeps its size.
+ */
+static int
+ldfont_lookup_many(lua_State *L){
+	int font = luaL_checkinteger(L,4);
+	int edge = luaL_checkinteger(L,5);
+	return lookup_glyphs(L,font,edge,0);
+}
+
+/*
+ * dfont:lookup_sdf(font, str|codes, fontkey [, spread])
+ * as lookup_many, with the distance fields of the glyphs rasterized by font at its reference size.
+ * the rects are spread pixels larger on every side, scale them to draw any size, see sdf.h
+ */
+static int
+ldfont_lookup_sdf(lua_State *L){
+	int font = luaL_checkinteger(L,4);
+	int spread = luaL_optinteger(L,5,SDF_SPREAD);
+	luaL_argcheck(L,spread > 0 && spread <= SDF_MAX_SPREAD,5,"invalid spread");
+	return lookup_glyphs(L,font,SDF_EDGE(spread),spread);
+}
+
+// queue the misses of dfont_lookup_many to the pool, they get a rect in pending
+static void
+request_misses(struct glyph_pool *pool, int id, const struct dfont_miss *miss, int nmiss, int font, int edge, const struct dfont_rect **rect, struct dfont_rect *pending){
+	int i;
+	for(i = 0;i < nmiss;i++){
+		const struct dfont_miss *m = &miss[i];
+		struct dfont_rect *p = &pending[m->index];
+		glyph_pool_request(pool,id,m->c,font,edge);
+		glyph_pool_size(pool,id,m->c,&p->w,&p->h);
+		p->x = -1;
+		p->y = -1;
+		p->page = -1;
+		rect[m->index] = p;
+	}
+}
+
+// look the chars up and queue the misses to the pool. return how many
+static int
+resolve_async(struct font_ud *ud, struct glyph_pool *pool, int id, const int *codes, int n, int font, int edge, const struct dfont_rect **rect, struct dfont_rect *pending){
+	struct dfont_miss miss[MAX_STRING];
+	int nmiss = dfont_lookup_many(ud->font,codes,n,font,edge,rect,miss);
+	request_misses(pool,id,miss,nmiss,font,edge,rect,pending);
+	return nmiss;
+}
+
+/*
+ * dfont:lookup_async(pool, fontid, str|codes, fontkey [, edge])
+ * return {x,y,w,h,page, ...} and the number of chars not ready. they are queued to the workers of the glyph pool,
+ * and get x = y = page = -1 with the size of their cell until dfont:collect(pool) brings them in.
+ * the edge of a distance field font is SDF_EDGE of its spread, see lookup_sdf
+ */
+static int
+ldfont_lookup_async(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct glyph_pool **pool = luaL_checkudata(L,2,POOL_NAME);
+	int id = luaL_checkinteger(L,3);
+	int font = luaL_checkinteger(L,5);
+	int edge = luaL_optinteger(L,6,0);
+	int codes[MAX_STRING];
+	const struct dfont_rect *rect[MAX_STRING];
+	struct dfont_rect pending[MAX_STRING];
+	luaL_argcheck(L,*pool != NULL,2,"released glyph pool");
+	int spread = glyph_pool_spread(*pool,id);
+	luaL_argcheck(L,spread >= 0,3,"invalid font id");
+	if(spread > 0){edge = SDF_EDGE(spread);}
+	int n = check_codes(L,4,codes);
+	int nmiss = resolve_async(ud,*pool,id,codes,n,font,edge,rect,pending);
+	push_rects(L,rect,n);
+	lua_pushinteger(L,nmiss);
+	return 2;
+}
+
+/*
+ * dfont:collect(pool)
+ * insert the glyphs the workers have finished, return {{x,y,w,h,page,glyph}, ...} to upload, empty with a mirror
+ */
+static int
+ldfont_collect(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct glyph_pool **pool = luaL_checkudata(L,2,POOL_NAME);
+	struct glyph_bitmap done[MAX_DONE];
+	int i,n,nupload = 0;
+	luaL_argcheck(L,*pool != NULL,2,"released glyph pool");
+	lua_newtable(L);
+	while((n = glyph_pool_done(*pool,done,MAX_DONE)) > 0){
+		for(i = 0;i < n;i++){
+			struct glyph_bitmap *g = &done[i];
+			const struct dfont_rect *r;
+			struct dfont_miss m;
+			if(g->pixels == NULL){continue;}
+			// a lookup_many of the same char may have rasterized it since
+			if(dfont_lookup_many(ud->font,&g->c,1,g->fontkey,g->edge,&r,&m) == 0){continue;}
+			r = dfont_insert_miss(ud->font,&m,g->w,g->h);
+			if(r == NULL){continue;}
+			if(ud->mirror){
+				dfont_write(ud->font,r,g->pixels,g->w);
+				continue;
+			}
+			push_glyph(L,r,g->pixels,g->w * g->h);
+			lua_rawseti(L,-2,++nupload);
+		}
+		glyph_pool_free(done,n);
+	}
+	return 1;
+}
+
+// a line break is laid out by text_layout, it is not a glyph to rasterize and insert
+static const struct dfont_rect line_break = {-1,-1,0,0,-1};
+
+// the chars of codes without the line breaks, to look up. return how many
+static int
+strip_breaks(const int *codes, int n, int *glyphs){
+	int i,m = 0;
+	for(i = 0;i < n;i++){
+		if(codes[i] != '\n'){glyphs[m++] = codes[i];}
+	}
+	return m;
+}
+
+// rect holds the rects of the glyphs of strip_breaks, spread them to the places of their chars in codes
+static void
+spread_breaks(const int *codes, int n, const struct dfont_rect **rect){
+	int i,k = n;
+	for(i = 0;i < n;i++){
+		if(codes[i] == '\n'){--k;}
 	}
+	for(i = n - 1;i >= 0;i--){
+		rect[i] = codes[i] == '\n' ? &line_break : rect[--k];
+	}
+}
+
+// x, y, scale, color [, wrap] from index
+static void
+check_style(lua_State *L, int index, struct text_style *s){
+	s->x = luaL_checknumber(L,index);
+	s->y = luaL_checknumber(L,index+1);
+	s->scale = luaL_checknumber(L,index+2);
+	s->color = (uint32_t)luaL_checkinteger(L,index+3);
+	s->wrap = luaL_optnumber(L,index+4,0);
+	s->pad = 0;
+}
+
+/*
+ * dfont:layout(buffer, font, str|codes, fontkey, x, y, scale, color [, wrap [, spread]])
+ * append the quads of the text to the text buffer, the glyphs are looked up as lookup_many does with edge 0,
+ * or as lookup_sdf with a spread. scale is the drawn size over the size of font, color is 0xRRGGBBAA.
+ * return the height of the text and the uploads of lookup_many
+ */
+static int
+ldfont_layout(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct text_buffer *b = luaL_checkudata(L,2,TEXT_NAME);
+	struct font_context *ctx = luaL_checkudata(L,3,FONT_NAME);
+	int font = luaL_checkinteger(L,5);
+	struct text_style style;
+	check_style(L,6,&style);
+	int spread = luaL_optinteger(L,11,0);
+	luaL_argcheck(L,spread >= 0 && spread <= SDF_MAX_SPREAD,11,"invalid spread");
+	int codes[MAX_STRING];
+	int glyphs[MAX_STRING];
+	const struct dfont_rect *rect[MAX_STRING];
+	struct dfont_rect failed[MAX_STRING];
+	int n = check_codes(L,4,codes);
+	int m = strip_breaks(codes,n,glyphs);
+	resolve_glyphs(L,ud,ctx,glyphs,m,font,spread > 0 ? SDF_EDGE(spread) : 0,spread,rect,failed);
+	spread_breaks(codes,n,rect);
+	style.pad = spread;
+	lua_pushnumber(L,text_layout(b,codes,rect,n,&style));
+	lua_insert(L,-2);
+	return 2;
+}
+
+/*
+ * dfont:layout_async(buffer, pool, fontid, str|codes, fontkey, x, y, scale, color [, wrap])
+ * as layout, with the glyphs of lookup_async : the ones not ready keep their place for a frame.
+ * return the height of the text and the number of chars not ready
+ */
+static int
+ldfont_layout_async(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct text_buffer *b = luaL_checkudata(L,2,TEXT_NAME);
+	struct glyph_pool **pool = luaL_checkudata(L,3,POOL_NAME);
+	int id = luaL_checkinteger(L,4);
+	int font = luaL_checkinteger(L,6);
+	struct text_style style;
+	check_style(L,7,&style);
+	luaL_argcheck(L,*pool != NULL,3,"released glyph pool");
+	int spread = glyph_pool_spread(*pool,id);
+	luaL_argcheck(L,spread >= 0,4,"invalid font id");
+	int codes[MAX_STRING];
+	int glyphs[MAX_STRING];
+	const struct dfont_rect *rect[MAX_STRING];
+	struct dfont_rect pending[MAX_STRING];
+	int n = check_codes(L,5,codes);
+	int m = strip_breaks(codes,n,glyphs);
+	int nmiss = resolve_async(ud,*pool,id,glyphs,m,font,spread > 0 ? SDF_EDGE(spread) : 0,rect,pending);
+	spread_breaks(codes,n,rect);
+	style.pad = spread;
+	lua_pushnumber(L,text_layout(b,codes,rect,n,&style));
+	lua_pushinteger(L,nmiss);
+	return 2;
+}
+
+/*
+ * dfont:layout_run(run, buffer, pool, fontid, str|codes, fontkey, x, y, scale, color [, wrap])
+ * as layout_async, with the quads kept in the text run : they are laid out again only when the text, the style
+ * or the rect of a glyph has changed, else the glyphs are only looked up to keep them in the atlas.
+ * the quads are appended to the buffer, it may be nil to draw the run from its own data.
+ * return the height of the text, the number of chars not ready and true when the quads were laid out again
+ */
+static int
+ldfont_layout_run(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct text_run *r = luaL_checkudata(L,2,RUN_NAME);
+	struct text_buffer *b = lua_isnil(L,3) ? NULL : luaL_checkudata(L,3,TEXT_NAME);
+	struct glyph_pool **pool = luaL_checkudata(L,4,POOL_NAME);
+	int id = luaL_checkinteger(L,5);
+	int font = luaL_checkinteger(L,7);
+	struct text_style style;
+	check_style(L,8,&style);
+	luaL_argcheck(L,*pool != NULL,4,"released glyph pool");
+	int spread = glyph_pool_spread(*pool,id);
+	luaL_argcheck(L,spread >= 0,5,"invalid font id");
+	int edge = spread > 0 ? SDF_EDGE(spread) : 0;
+	int codes[MAX_STRING];
+	int glyphs[MAX_STRING];
+	const struct dfont_rect *rect[MAX_STRING];
+	struct dfont_rect pending[MAX_STRING];
+	struct dfont_miss miss[MAX_STRING];
+	int n = check_codes(L,6,codes);
+	style.pad = spread;
+	// the scales of the buffer the run was laid out for
+	const struct text_buffer *scales = b ? b : &r->b;
+	int m = strip_breaks(codes,n,glyphs);
+	int nmiss = dfont_lookup_many(ud->font,glyphs,m,font,edge,rect,miss);
+	request_misses(*pool,id,miss,nmiss,font,edge,rect,pending);
+	spread_breaks(codes,n,rect);
+	int rebuilt = 0;
+	if(nmiss > 0 || !text_run_match(r,scales,codes,n,font,edge,&style) || !text_run_valid(r,rect)){
+		text_run_layout(r,scales,codes,rect,n,font,edge,&style);
+		rebuilt = 1;
+	}
+	if(b){text_buffer_append(b,r);}
+	lua_pushnumber(L,r->height);
+	lua_pushinteger(L,nmiss);
+	lua_pushboolean(L,rebuilt);
+	return 3;
+}
+
+// the codepoints of a charset : a utf8 string, or a table of codepoints and {first, last} ranges.
+// they are in a userdata pushed on the stack
+static int *
+check_charset(lua_State *L, int index, int *n){
+	index = lua_absindex(L,index);
+	if(lua_type(L,index) != LUA_TTABLE){
+		size_t sz;
+		const char *str = luaL_checklstring(L,index,&sz);
+		int *codes = lua_newuserdata(L,(sz + 1) * sizeof(int));
+		*n = utf8_decode(str,sz,codes,sz);
+		luaL_argcheck(L,*n >= 0,index,"invalid utf8 string");
+		return codes;
+	}
+	int len = lua_rawlen(L,index);
+	int i,j,count = 0;
+	for(i = 1;i <= len;i++){
+		if(lua_rawgeti(L,index,i) == LUA_TTABLE){
+			lua_rawgeti(L,-1,1);
+			lua_rawgeti(L,-2,2);
+			luaL_argcheck(L,lua_isinteger(L,-2) && lua_isinteger(L,-1),index,"invalid range");
+			lua_Integer first = lua_tointeger(L,-2);
+			lua_Integer last = lua_tointeger(L,-1);
+			luaL_argcheck(L,first >= 0 && first <= last && last <= MAX_CODEPOINT,index,"invalid range");
+			luaL_argcheck(L,last - first + 1 <= MAX_CHARSET - count,index,"charset too large");
+			count += (int)(last - first + 1);
+			lua_pop(L,2);
+		} else {
+			luaL_argcheck(L,lua_isinteger(L,-1),index,"invalid codepoint");
+			lua_Integer c = lua_tointeger(L,-1);
+			luaL_argcheck(L,c >= 0 && c <= MAX_CODEPOINT,index,"invalid codepoint");
+			luaL_argcheck(L,count < MAX_CHARSET,index,"charset too large");
+			++count;
+		}
+		lua_pop(L,1);
+	}
+	int *codes = lua_newuserdata(L,(count + 1) * sizeof(int));
+	*n = 0;
+	for(i = 1;i <= len;i++){
+		if(lua_rawgeti(L,index,i) == LUA_TTABLE){
+			lua_rawgeti(L,-1,1);
+			lua_rawgeti(L,-2,2);
+			int last = lua_tointeger(L,-1);
+			// the ranges are checked above, count holds them all
+			for(j = lua_tointeger(L,-2);j <= last;j++){
+				codes[(*n)++] = j;
+			}
+			lua_pop(L,2);
+		} else {
+			codes[(*n)++] = lua_tointeger(L,-1);
+		}
+		lua_pop(L,1);
+	}
+	return codes;
+}
+
+struct warm_font {
+	int id;
+	int fontkey;
+	int edge;
+};
+
+struct warm_list {
+	struct glyph_bitmap *g;
+	int n;
+	int cap;
+};
+
+// block until some glyphs are finished. return 0 when there is nothing more to wait for
+static int
+warm_gather(struct warm_list *w, struct glyph_pool *pool){
+	if(w->n + MAX_DONE > w->cap){
+		w->cap = w->cap * 2 + MAX_DONE;
+		w->g = realloc(w->g,w->cap * sizeof(*w->g));
+	}
+	int n = glyph_pool_wait(pool,w->g + w->n,MAX_DONE);
+	w->n += n;
+	return n;
+}
+
+// the tallest first, then by font and codepoint : the lines of a height class fill one after another
+static int
+warm_order(const void *a, const void *b){
+	const struct glyph_bitmap *x = a;
+	const struct glyph_bitmap *y = b;
+	if(x->h != y->h){return y->h - x->h;}
+	if(x->fontkey != y->fontkey){return x->fontkey - y->fontkey;}
+	if(x->edge != y->edge){return x->edge - y->edge;}
+	return x->c - y->c;
+}
+
+/*
+ * dfont:prewarm(pool, charset, {fontid, fontkey, ...} [, priority])
+ * rasterize the chars of the charset missing for every font across the workers of the pool, wait for all of them,
+ * then insert them sorted by height and codepoint. the metrics of the chars are cached for layout_async too. charset is a string or {c, {first, last}, ...}.
+ * return {{x,y,w,h,page,glyph}, ...} to upload, empty with a mirror : dfont:flush_uploads sends them at once.
+ * the number inserted and the number that found no room follow. with a priority, see dfont:priority, it is set to every char of the charset
+ */
+static int
+ldfont_prewarm(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct glyph_pool **pool = luaL_checkudata(L,2,POOL_NAME);
+	luaL_checktype(L,4,LUA_TTABLE);
+	int priority = luaL_optinteger(L,5,-1);
+	luaL_argcheck(L,*pool != NULL,2,"released glyph pool");
+	struct warm_font fonts[MAX_WARM_FONT];
+	int nfont = lua_rawlen(L,4) / 2;
+	int i,j,k;
+	luaL_argcheck(L,nfont <= MAX_WARM_FONT,4,"too many fonts");
+	for(i = 0;i < nfont;i++){
+		struct warm_font *f = &fonts[i];
+		lua_rawgeti(L,4,i * 2 + 1);
+		lua_rawgeti(L,4,i * 2 + 2);
+		f->id = luaL_checkinteger(L,-2);
+		f->fontkey = luaL_checkinteger(L,-1);
+		lua_pop(L,2);
+		int spread = glyph_pool_spread(*pool,f->id);
+		luaL_argcheck(L,spread >= 0,4,"invalid font id");
+		f->edge = spread > 0 ? SDF_EDGE(spread) : 0;
+	}
+	int n;
+	int *codes = check_charset(L,3,&n);
+	for(i = 0;i < nfont;i++){
+		glyph_pool_metrics(*pool,fonts[i].id,codes,n);
+	}
+	lua_newtable(L);
+	// no lua error from here until the bitmaps are freed
+	struct warm_list w = {NULL,0,0};
+	const struct dfont_rect *rect[MAX_STRING];
+	struct dfont_miss miss[MAX_STRING];
+	for(i = 0;i < nfont;i++){
+		struct warm_font *f = &fonts[i];
+		for(j = 0;j < n;j += MAX_STRING){
+			int count = n - j < MAX_STRING ? n - j : MAX_STRING;
+			int nmiss = dfont_lookup_many(ud->font,codes + j,count,f->fontkey,f->edge,rect,miss);
+			for(k = 0;k < nmiss;k++){
+				// the queue is full, make room by taking the finished ones
+				while(glyph_pool_request(*pool,f->id,miss[k].c,f->fontkey,f->edge) < 0){
+					if(warm_gather(&w,*pool) == 0){break;}
+				}
+			}
+		}
+	}
+	while(glyph_pool_pending(*pool) > 0){
+		if(warm_gather(&w,*pool) == 0){break;}
+	}
+	qsort(w.g,w.n,sizeof(*w.g),warm_order);
+	int inserted = 0,failed = 0,nupload = 0;
+	for(i = 0;i < w.n;i++){
+		struct glyph_bitmap *g = &w.g[i];
+		const struct dfont_rect *r;
+		struct dfont_miss m;
+		if(g->pixels == NULL){continue;}
+		if(dfont_lookup_many(ud->font,&g->c,1,g->fontkey,g->edge,&r,&m) == 0){continue;}
+		r = dfont_insert_miss(ud->font,&m,g->w,g->h);
+		if(r == NULL){
+			++failed;
+			continue;
+		}
+		++inserted;
+		if(ud->mirror){
+			dfont_write(ud->font,r,g->pixels,g->w);
+			continue;
+		}
+		push_glyph(L,r,g->pixels,g->w * g->h);
+		lua_rawseti(L,-2,++nupload);
+	}
+	glyph_pool_free(w.g,w.n);
+	free(w.g);
+	if(priority >= 0){
+		for(i = 0;i < nfont;i++){
+			for(j = 0;j < n;j++){
+				dfont_priority(ud->font,codes[j],fonts[i].fontkey,fonts[i].edge,priority);
+			}
+		}
+	}
+	lua_pushinteger(L,inserted);
+	lua_pushinteger(L,failed);
+	return 3;
 }
 
 static int
@@ -61,6 +747,291 @@ ldfont_flush(lua_State *L){
 	return 0;
 }
 
+/*
+ * dfont:priority(str|codes, fontkey, edge [, priority])
+ * set the eviction class of the chars already in, the default pins them. return how many were found
+ */
+static int
+ldfont_priority(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	int font = luaL_checkinteger(L,3);
+	int edge = luaL_checkinteger(L,4);
+	int priority = luaL_optinteger(L,5,DFONT_PIN);
+	int codes[MAX_STRING];
+	int n = check_codes(L,2,codes);
+	int i,found = 0;
+	for(i = 0;i < n;i++){
+		found += dfont_priority(ud->font,codes[i],font,edge,priority);
+	}
+	lua_pushinteger(L,found);
+	return 1;
+}
+
+/*
+ * dfont:height_class(step [, growth])
+ * glyph heights share lines rounded up to step, or to buckets growing by growth percent
+ */
+static int
+ldfont_height_class(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	int step = luaL_checkinteger(L,2);
+	int growth = luaL_optinteger(L,3,0);
+	dfont_height_class(ud->font,step,growth);
+	return 0;
+}
+
+/*
+ * dfont:mirror()
+ * keep the atlas pixels in memory, lookup_many then returns no upload
+ * and the new glyphs are uploaded by flush_uploads
+ */
+static int
+ldfont_mirror(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	if(ud->mirror == NULL){
+		size_t size = dfont_mirror_size(ud->font);
+		ud->mirror = malloc(size);
+		memset(ud->mirror,0,size);
+		dfont_mirror(ud->font,ud->mirror);
+	}
+	return 0;
+}
+
+static void
+push_upload(void *ud,int page,int x,int y,int w,int h,const void *pixels,int pitch){
+	lua_State *L = ud;
+	int n = lua_rawlen(L,-1);
+	lua_pushinteger(L,page);
+	lua_rawseti(L,-2,n+1);
+	lua_pushinteger(L,x);
+	lua_rawseti(L,-2,n+2);
+	lua_pushinteger(L,y);
+	lua_rawseti(L,-2,n+3);
+	lua_pushinteger(L,w);
+	lua_rawseti(L,-2,n+4);
+	lua_pushinteger(L,h);
+	lua_rawseti(L,-2,n+5);
+	lua_pushlightuserdata(L,(void *)pixels);
+	lua_rawseti(L,-2,n+6);
+}
+
+/*
+ * dfont:flush_uploads()
+ * return {page,x,y,w,h,pixels, ...} the regions written since the last call,
+ * pixels is a lightuserdata with rows of the atlas width, see GL_UNPACK_ROW_LENGTH
+ */
+static int
+ldfont_flush_uploads(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	lua_newtable(L);
+	if(ud->mirror){
+		dfont_flush_uploads(ud->font,push_upload,L);
+	}
+	return 1;
+}
+
+/*
+ * dfont:trace([path])
+ * record every call to path for the replay tool, stop recording without path
+ */
+static int
+ldfont_trace(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	const char *path = luaL_optstring(L,2,NULL);
+	dfont_trace(ud->font,NULL);
+	if(ud->trace){
+		fclose(ud->trace);
+		ud->trace = NULL;
+	}
+	if(path){
+		ud->trace = fopen(path,"wb");
+		if(ud->trace == NULL){return luaL_error(L,"can't open %s",path);}
+		dfont_trace(ud->font,ud->trace);
+	}
+	return 0;
+}
+
+static int
+ldfont_pages(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	lua_pushinteger(L,dfont_pages(ud->font));
+	return 1;
+}
+
+static int
+ldfont_evict_page(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	int page = luaL_checkinteger(L,2);
+	lua_pushinteger(L,dfont_evict_page(ud->font,page));
+	return 1;
+}
+
+/*
+ * dfont:compact(page)
+ * return {sx,sy,dx,dy,w,h, ...}, copy every rect from the page as it was before the call.
+ * return nil when the page can't be repacked.
+ */
+static int
+ldfont_compact(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	int page = luaL_checkinteger(L,2);
+	struct dfont_move tmp[256];
+	struct dfont_move *moves = tmp;
+	int n = dfont_compact(ud->font,page,moves,256);
+	if(n > 256){
+		moves = lua_newuserdata(L,n * sizeof(*moves));
+		n = dfont_compact(ud->font,page,moves,n);
+	}
+	if(n < 0){return 0;}
+	lua_createtable(L,n*6,0);
+	int i;
+	for(i = 0;i < n;i++){
+		lua_pushinteger(L,moves[i].src.x);
+		lua_rawseti(L,-2,i*6+1);
+		lua_pushinteger(L,moves[i].src.y);
+		lua_rawseti(L,-2,i*6+2);
+		lua_pushinteger(L,moves[i].dst.x);
+		lua_rawseti(L,-2,i*6+3);
+		lua_pushinteger(L,moves[i].dst.y);
+		lua_rawseti(L,-2,i*6+4);
+		lua_pushinteger(L,moves[i].src.w);
+		lua_rawseti(L,-2,i*6+5);
+		lua_pushinteger(L,moves[i].src.h);
+		lua_rawseti(L,-2,i*6+6);
+	}
+	return 1;
+}
+
+static int
+ldfont_stats(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct dfont_stats st;
+	dfont_stats(ud->font,&st);
+	lua_createtable(L,0,17);
+	lua_pushinteger(L,st.hit);
+	lua_setfield(L,-2,"hit");
+	lua_pushinteger(L,st.miss);
+	lua_setfield(L,-2,"miss");
+	lua_pushinteger(L,st.insert);
+	lua_setfield(L,-2,"insert");
+	lua_pushinteger(L,st.failed);
+	lua_setfield(L,-2,"failed");
+	lua_pushinteger(L,st.evict_lru);
+	lua_setfield(L,-2,"evict_lru");
+	lua_pushinteger(L,st.evict_line);
+	lua_setfield(L,-2,"evict_line");
+	lua_pushinteger(L,st.evict_page);
+	lua_setfield(L,-2,"evict_page");
+	lua_pushinteger(L,st.pages);
+	lua_setfield(L,-2,"pages");
+	lua_pushinteger(L,st.lines);
+	lua_setfield(L,-2,"lines");
+	lua_pushinteger(L,st.rects);
+	lua_setfield(L,-2,"rects");
+	lua_pushinteger(L,st.working_set);
+	lua_setfield(L,-2,"working_set");
+	lua_pushinteger(L,st.pixels);
+	lua_setfield(L,-2,"pixels");
+	lua_pushinteger(L,st.line_pixels);
+	lua_setfield(L,-2,"line_pixels");
+	lua_pushinteger(L,st.total_pixels);
+	lua_setfield(L,-2,"total_pixels");
+	lua_pushinteger(L,st.working_pixels);
+	lua_setfield(L,-2,"working_pixels");
+	lua_pushnumber(L,st.fragmentation);
+	lua_setfield(L,-2,"fragmentation");
+	return 1;
+}
+
+/*
+ * dfont:line_stats()
+ * return {page,y,height,rects,used,hole, ...} for every line holding glyphs
+ */
+static int
+ldfont_line_stats(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	int n = dfont_line_stats(ud->font,NULL,0);
+	struct dfont_line_stats *lines = lua_newuserdata(L,n * sizeof(*lines) + 1);
+	n = dfont_line_stats(ud->font,lines,n);
+	lua_createtable(L,n*6,0);
+	int i;
+	for(i = 0;i < n;i++){
+		lua_pushinteger(L,lines[i].page);
+		lua_rawseti(L,-2,i*6+1);
+		lua_pushinteger(L,lines[i].y);
+		lua_rawseti(L,-2,i*6+2);
+		lua_pushinteger(L,lines[i].height);
+		lua_rawseti(L,-2,i*6+3);
+		lua_pushinteger(L,lines[i].rects);
+		lua_rawseti(L,-2,i*6+4);
+		lua_pushinteger(L,lines[i].used);
+		lua_rawseti(L,-2,i*6+5);
+		lua_pushinteger(L,lines[i].hole);
+		lua_rawseti(L,-2,i*6+6);
+	}
+	return 1;
+}
+
+static uint64_t
+check_fingerprint(lua_State *L,int idx){
+	size_t sz;
+	const char *key = luaL_checklstring(L,idx,&sz);
+	return dfont_fingerprint(key,sz,0);
+}
+
+/*
+ * dfont:snapshot(key, pixels, ...)
+ * key is the font name and size the glyphs were rasterized with,
+ * pass the A8 pixels (string or lightuserdata) of every page, unless the dfont has a mirror. return the snapshot string
+ */
+static int
+ldfont_snapshot(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	uint64_t fp = check_fingerprint(L,2);
+	int pages = dfont_pages(ud->font);
+	// a userdata, the checks below may raise an error
+	const void **pixels = lua_newuserdata(L,pages * sizeof(*pixels));
+	size_t page_size = (size_t)ud->width * ud->height;
+	int i;
+	for(i = 0;i < pages && ud->mirror == NULL;i++){
+		if(lua_type(L,i+3) == LUA_TLIGHTUSERDATA){
+			pixels[i] = lua_touserdata(L,i+3);
+		} else {
+			size_t sz;
+			pixels[i] = luaL_checklstring(L,i+3,&sz);
+			luaL_argcheck(L,sz >= page_size,i+3,"pixels of a page expected");
+		}
+	}
+	size_t size = dfont_snapshot_size(ud->font);
+	luaL_Buffer b;
+	char *buf = luaL_buffinitsize(L,&b,size);
+	size = dfont_snapshot(ud->font,fp,ud->mirror ? NULL : pixels,buf,size);
+	luaL_pushresultsize(&b,size);
+	return 1;
+}
+
+/*
+ * dfont:restore(snapshot, key)
+ * snapshot is a string or the userdata of font.snapshot_open. return true when it matches the key and the atlas
+ */
+static int
+ldfont_restore(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	const void *data;
+	size_t size;
+	if(lua_type(L,2) == LUA_TSTRING){
+		data = lua_tolstring(L,2,&size);
+	} else {
+		struct snapshot_ud *snap = luaL_checkudata(L,2,SNAPSHOT_NAME);
+		luaL_argcheck(L,snap->data != NULL,2,"snapshot closed");
+		data = snap->data;
+		size = snap->size;
+	}
+	uint64_t fp = check_fingerprint(L,3);
+	lua_pushboolean(L,dfont_restore(ud->font,fp,data,size));
+	return 1;
+}
+
 static int
 ldfont_dump(lua_State *L){
 	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
@@ -68,16 +1039,74 @@ ldfont_dump(lua_State *L){
 	return 0;
 }
 
+/*
+ * dfont:requests()
+ * return {c,font,edge, ...} the glyphs asked by the clients and not in the atlas, pass them to lookup_many
+ */
 static int
-ldfont_create(lua_State *L){
-	int w = luaL_checkinteger(L,1);
-	int h = luaL_checkinteger(L,2);
+ldfont_requests(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,DFONT_NAME);
+	struct dfont_miss miss[MAX_STRING];
+	int n = dfont_requests(ud->font,miss,MAX_STRING);
+	int i;
+	lua_createtable(L,n*3,0);
+	for(i = 0;i < n;i++){
+		lua_pushinteger(L,miss[i].c);
+		lua_rawseti(L,-2,i*3+1);
+		lua_pushinteger(L,miss[i].font);
+		lua_rawseti(L,-2,i*3+2);
+		lua_pushinteger(L,miss[i].edge);
+		lua_rawseti(L,-2,i*3+3);
+	}
+	return 1;
+}
+
+static struct font_ud *
+new_dfont(lua_State *L, int w, int h){
 	struct font_ud *ud = lua_newuserdata(L,sizeof(*ud));
-	ud->font = dfont_create(w,h);
+	ud->font = NULL;
+	ud->width = w;
+	ud->height = h;
+	ud->mirror = NULL;
+	ud->trace = NULL;
+	ud->scratch = NULL;
+	ud->scratch_size = 0;
+	ud->sdf = NULL;
+	ud->sdf_size = 0;
+	ud->shared = NULL;
+	ud->shared_size = 0;
+	ud->shared_handle = NULL;
+	ud->shared_name = NULL;
+	return ud;
+}
+
+static void
+dfont_metatable(lua_State *L){
 	static luaL_Reg f[] = {
 		{"lookup",ldfont_lookup},
 		{"insert",ldfont_insert},
+		{"lookup_many",ldfont_lookup_many},
+		{"lookup_sdf",ldfont_lookup_sdf},
+		{"lookup_async",ldfont_lookup_async},
+		{"collect",ldfont_collect},
+		{"prewarm",ldfont_prewarm},
+		{"layout",ldfont_layout},
+		{"layout_async",ldfont_layout_async},
+		{"layout_run",ldfont_layout_run},
 		{"flush",ldfont_flush},
+		{"priority",ldfont_priority},
+		{"height_class",ldfont_height_class},
+		{"mirror",ldfont_mirror},
+		{"flush_uploads",ldfont_flush_uploads},
+		{"trace",ldfont_trace},
+		{"pages",ldfont_pages},
+		{"evict_page",ldfont_evict_page},
+		{"compact",ldfont_compact},
+		{"stats",ldfont_stats},
+		{"line_stats",ldfont_line_stats},
+		{"snapshot",ldfont_snapshot},
+		{"restore",ldfont_restore},
+		{"requests",ldfont_requests},
 		{"dump",ldfont_dump},
 		{"__gc",ldfont_release},
 		{NULL,NULL}
@@ -87,6 +1116,246 @@ ldfont_create(lua_State *L){
 		lua_setfield(L,-2,"__index");
 	}
 	lua_setmetatable(L,-2);
+}
+
+static int
+ldfont_create(lua_State *L){
+	int w = luaL_checkinteger(L,1);
+	int h = luaL_checkinteger(L,2);
+	int pages = luaL_optinteger(L,3,1);
+	struct font_ud *ud = new_dfont(L,w,h);
+	ud->font = dfont_create_pages(w,h,pages);
+	dfont_metatable(L);
+	return 1;
+}
+
+#if !defined(_WIN32)
+// the segment name holds a shared dfont whose owner process is gone
+static int
+shared_stale(const char *name){
+	int fd = shm_open(name,O_RDONLY,0);
+	if(fd < 0){return 0;}
+	struct stat st;
+	int stale = 0;
+	if(fstat(fd,&st) == 0 && st.st_size > 0){
+		void *data = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		if(data != MAP_FAILED){
+			// a block without a finished header may be an owner still in dfont_shared_init
+			struct dfont *df = dfont_shared_attach(data,st.st_size);
+			stale = df != NULL && kill(dfont_shared_owner(df),0) != 0 && errno == ESRCH;
+			munmap(data,st.st_size);
+		}
+	}
+	close(fd);
+	return stale;
+}
+#endif
+
+static void *
+shared_map(struct font_ud *ud,const char *name,size_t size,int create){
+#if defined(_WIN32)
+	HANDLE map;
+	if(create){
+		map = CreateFileMappingA(INVALID_HANDLE_VALUE,NULL,PAGE_READWRITE,(DWORD)((uint64_t)size >> 32),(DWORD)size,name);
+		if(map != NULL && GetLastError() == ERROR_ALREADY_EXISTS){
+			// another owner is running
+			CloseHandle(map);
+			return NULL;
+		}
+	} else {
+		map = OpenFileMappingA(FILE_MAP_ALL_ACCESS,FALSE,name);
+	}
+	if(map == NULL){return NULL;}
+	void *data = MapViewOfFile(map,FILE_MAP_ALL_ACCESS,0,0,0);
+	MEMORY_BASIC_INFORMATION info;
+	if(data == NULL || VirtualQuery(data,&info,sizeof(info)) == 0){
+		if(data){UnmapViewOfFile(data);}
+		CloseHandle(map);
+		return NULL;
+	}
+	if(create){
+		// the name lives as long as a handle is open
+		ud->shared_handle = map;
+	} else {
+		CloseHandle(map);
+		size = info.RegionSize;
+	}
+#else
+	int fd;
+	if(create){
+		// fail like windows when another owner is running
+		fd = shm_open(name,O_CREAT|O_EXCL|O_RDWR,0600);
+		if(fd < 0 && errno == EEXIST && shared_stale(name)){
+			// a segment left by an owner that died is replaced, its clients keep the old one
+			shm_unlink(name);
+			fd = shm_open(name,O_CREAT|O_EXCL|O_RDWR,0600);
+		}
+		if(fd >= 0 && ftruncate(fd,size) != 0){
+			close(fd);
+			shm_unlink(name);
+			return NULL;
+		}
+	} else {
+		fd = shm_open(name,O_RDWR,0);
+	}
+	if(fd < 0){return NULL;}
+	struct stat st;
+	void *data = NULL;
+	if(fstat(fd,&st) == 0 && st.st_size > 0){
+		size = st.st_size;
+		data = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		if(data == MAP_FAILED){data = NULL;}
+	}
+	close(fd);
+	if(data == NULL){
+		if(create){shm_unlink(name);}
+		return NULL;
+	}
+	if(create){
+		ud->shared_name = strdup(name);
+	}
+#endif
+	ud->shared = data;
+	ud->shared_size = size;
+	return data;
+}
+
+static void
+shared_unmap(struct font_ud *ud){
+#if defined(_WIN32)
+	UnmapViewOfFile(ud->shared);
+	if(ud->shared_handle){CloseHandle(ud->shared_handle);}
+#else
+	munmap(ud->shared,ud->shared_size);
+	if(ud->shared_name){shm_unlink(ud->shared_name);}
+	free(ud->shared_name);
+#endif
+	ud->shared = NULL;
+	ud->shared_handle = NULL;
+	ud->shared_name = NULL;
+	// the mirror was in the mapping
+	ud->mirror = NULL;
+}
+
+/*
+ * font.dfont_shared(name, w, h [, pages])
+ * a dfont with a mirror in the shared memory name ("/name" on posix), other processes open it with font.dfont_attach.
+ * this process rasterizes : it takes the glyphs they ask for from dfont:requests. return nil when name can't be created
+ * or a live owner already serves it
+ */
+static int
+ldfont_shared(lua_State *L){
+	const char *name = luaL_checkstring(L,1);
+	int w = luaL_checkinteger(L,2);
+	int h = luaL_checkinteger(L,3);
+	int pages = luaL_optinteger(L,4,1);
+	struct font_ud *ud = new_dfont(L,w,h);
+	void *block = shared_map(ud,name,dfont_shared_size(w,h,pages),1);
+	if(block == NULL){return 0;}
+	dfont_metatable(L);
+	ud->font = dfont_shared_init(block,w,h,pages);
+	// the mirror is at the end of the block
+	ud->mirror = (char *)block + dfont_shared_size(w,h,pages) - dfont_mirror_size(ud->font);
+	return 1;
+}
+
+static int
+lclient_lookup(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,CLIENT_NAME);
+	int c = luaL_checkinteger(L,2);
+	int font = luaL_checkinteger(L,3);
+	int edge = luaL_checkinteger(L,4);
+	struct dfont_rect rect;
+	luaL_argcheck(L,ud->shared != NULL,1,"dfont closed");
+	if(!dfont_lookup_rect(ud->font,c,font,edge,&rect)){return 0;}
+	lua_pushinteger(L,rect.x);
+	lua_pushinteger(L,rect.y);
+	lua_pushinteger(L,rect.w);
+	lua_pushinteger(L,rect.h);
+	lua_pushinteger(L,rect.page);
+	return 5;
+}
+
+/*
+ * client:read(c, font, edge)
+ * return x,y,w,h,page,pixels with the A8 pixels w bytes a row as lightuserdata, valid until the next read.
+ * nothing when the glyph is not in the shared atlas yet, see client:request
+ */
+static int
+lclient_read(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,CLIENT_NAME);
+	int c = luaL_checkinteger(L,2);
+	int font = luaL_checkinteger(L,3);
+	int edge = luaL_checkinteger(L,4);
+	struct dfont_rect rect,got;
+	luaL_argcheck(L,ud->shared != NULL,1,"dfont closed");
+	for(;;){
+		if(!dfont_lookup_rect(ud->font,c,font,edge,&rect)){return 0;}
+		int size = rect.w * rect.h;
+		if(size > ud->scratch_size){
+			free(ud->scratch);
+			ud->scratch = malloc(size);
+			ud->scratch_size = size;
+		}
+		if(!dfont_read(ud->font,c,font,edge,&got,ud->scratch,rect.w)){return 0;}
+		// the owner replaced the glyph between the two calls
+		if(got.w == rect.w && got.h == rect.h){break;}
+	}
+	lua_pushinteger(L,got.x);
+	lua_pushinteger(L,got.y);
+	lua_pushinteger(L,got.w);
+	lua_pushinteger(L,got.h);
+	lua_pushinteger(L,got.page);
+	lua_pushlightuserdata(L,ud->scratch);
+	return 6;
+}
+
+static int
+lclient_request(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,CLIENT_NAME);
+	int c = luaL_checkinteger(L,2);
+	int font = luaL_checkinteger(L,3);
+	int edge = luaL_checkinteger(L,4);
+	luaL_argcheck(L,ud->shared != NULL,1,"dfont closed");
+	dfont_request(ud->font,c,font,edge);
+	return 0;
+}
+
+static int
+lclient_close(lua_State *L){
+	struct font_ud *ud = luaL_checkudata(L,1,CLIENT_NAME);
+	if(ud->shared){shared_unmap(ud);}
+	free(ud->scratch);
+	ud->scratch = NULL;
+	ud->font = NULL;
+	return 0;
+}
+
+/*
+ * font.dfont_attach(name)
+ * open the dfont of font.dfont_shared in another process, return nil until the owner has made it
+ */
+static int
+ldfont_attach(lua_State *L){
+	const char *name = luaL_checkstring(L,1);
+	struct font_ud *ud = new_dfont(L,0,0);
+	static luaL_Reg f[] = {
+		{"lookup",lclient_lookup},
+		{"read",lclient_read},
+		{"request",lclient_request},
+		{"close",lclient_close},
+		{"__gc",lclient_close},
+		{NULL,NULL}
+	};
+	if(luaL_newmetatable(L,CLIENT_NAME)){
+		luaL_newlib(L,f);
+		lua_setfield(L,-2,"__index");
+	}
+	lua_setmetatable(L,-2);
+	void *block = shared_map(ud,name,0,0);
+	if(block == NULL){return 0;}
+	ud->font = dfont_shared_attach(block,ud->shared_size);
+	if(ud->font == NULL){return 0;}
 	return 1;
 }
 
@@ -101,30 +1370,79 @@ static int
 lfont_size(lua_State *L){
 	struct font_context *ud = luaL_checkudata(L,1,FONT_NAME);
 	int c = luaL_checkinteger(L,2);
+	luaL_argcheck(L,c >= 0,2,"invalid codepoint");
 	font_size(NULL,c,ud);
 	lua_pushinteger(L,ud->w);
 	lua_pushinteger(L,ud->h);
 	return 2;
 }
 
+/*
+ * font:metrics(c)
+ * return advance, x, y, w, h : the black box from the origin on the baseline, y down. measured once, then cached
+ */
+static int
+lfont_metrics(lua_State *L){
+	struct font_context *ud = luaL_checkudata(L,1,FONT_NAME);
+	int c = luaL_checkinteger(L,2);
+	luaL_argcheck(L,c >= 0,2,"invalid codepoint");
+	const struct glyph_metrics *m = font_metrics(c,ud);
+	lua_pushinteger(L,m->advance);
+	lua_pushinteger(L,m->x);
+	lua_pushinteger(L,m->y);
+	lua_pushinteger(L,m->w);
+	lua_pushinteger(L,m->h);
+	return 5;
+}
+
+/*
+ * font:prewarm(charset)
+ * measure the chars of the charset, see dfont:prewarm, so that font:size and font:metrics don't call the system
+ */
+static int
+lfont_prewarm(lua_State *L){
+	struct font_context *ud = luaL_checkudata(L,1,FONT_NAME);
+	int n;
+	int *codes = check_charset(L,2,&n);
+	font_metrics_prewarm(codes,n,ud);
+	return 0;
+}
+
+/*
+ * font:glyph(c)
+ * return the pixels of the cell, w, h. only the cell is cleared, the rasterizer draws into the lua buffer
+ */
 static int
 lfont_glyph(lua_State *L){
-	char buf[255*255]={0};
 	struct font_context *ud = luaL_checkudata(L,1,FONT_NAME);
 	int c = luaL_checkinteger(L,2);
-	font_glyph(NULL,c,buf,ud);
-	int size = ud->w * ud->h;
-	lua_pushlstring(L,buf,size);
-	return 1;
+	luaL_Buffer b;
+	char *buf = luaL_buffinitsize(L,&b,LUAL_BUFFERSIZE);
+	int size = font_render(c,ud,buf,LUAL_BUFFERSIZE);
+	if(size > LUAL_BUFFERSIZE){
+		buf = luaL_prepbuffsize(&b,size);
+		font_render(c,ud,buf,size);
+	}
+	luaL_pushresultsize(&b,size);
+	lua_pushinteger(L,ud->w);
+	lua_pushinteger(L,ud->h);
+	return 3;
 }
 
+/*
+ * font.font_create(size [, name])
+ * name is the face (GDI), nil for the default one, or the font file (stb_truetype), which has no default
+ */
 static int
 lfont_create(lua_State *L){
 	int size = luaL_checkinteger(L,1);
+	const char *name = luaL_optstring(L,2,NULL);
 	struct font_context *ud = lua_newuserdata(L,sizeof(*ud));
-	font_create(size,ud);
+	if(!font_create(name,size,ud)){return luaL_error(L,"can't create font %s",name ? name : "(default)");}
 	static luaL_Reg f[] = {
 		{"size",lfont_size},
+		{"metrics",lfont_metrics},
+		{"prewarm",lfont_prewarm},
 		{"glyph",lfont_glyph},
 		{"__gc",lfont_release},
 		{NULL,NULL}
@@ -137,11 +1455,406 @@ lfont_create(lua_State *L){
 	return 1;
 }
 
+static int
+lsnapshot_close(lua_State *L){
+	struct snapshot_ud *ud = luaL_checkudata(L,1,SNAPSHOT_NAME);
+	if(ud->data){
+#if defined(_WIN32)
+		UnmapViewOfFile(ud->data);
+#else
+		munmap((void *)ud->data,ud->size);
+#endif
+		ud->data = NULL;
+	}
+	return 0;
+}
+
+/*
+ * snapshot:pixels(page)
+ * return the A8 pixels of the page as lightuserdata for glTexImage2D, valid until the snapshot is closed
+ */
+static int
+lsnapshot_pixels(lua_State *L){
+	struct snapshot_ud *ud = luaL_checkudata(L,1,SNAPSHOT_NAME);
+	int page = luaL_checkinteger(L,2);
+	luaL_argcheck(L,ud->data != NULL,1,"snapshot closed");
+	const void *pixels = dfont_snapshot_pixels(ud->data,ud->size,page);
+	if(pixels == NULL){return 0;}
+	lua_pushlightuserdata(L,(void *)pixels);
+	return 1;
+}
+
+static const void *
+map_file(const char *path,size_t *size){
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if(file == INVALID_HANDLE_VALUE){return NULL;}
+	LARGE_INTEGER sz;
+	HANDLE map = NULL;
+	if(GetFileSizeEx(file,&sz) && sz.QuadPart > 0){
+		map = CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+	}
+	CloseHandle(file);
+	if(map == NULL){return NULL;}
+	const void *data = MapViewOfFile(map,FILE_MAP_READ,0,0,0);
+	CloseHandle(map);
+	*size = (size_t)sz.QuadPart;
+	return data;
+#else
+	int fd = open(path,O_RDONLY);
+	if(fd < 0){return NULL;}
+	struct stat st;
+	void *data = NULL;
+	if(fstat(fd,&st) == 0 && st.st_size > 0){
+		data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(data == MAP_FAILED){data = NULL;}
+		*size = st.st_size;
+	}
+	close(fd);
+	return data;
+#endif
+}
+
+/*
+ * font.snapshot_open(path)
+ * map a file written from dfont:snapshot, return nil when it can't be opened
+ */
+static int
+lsnapshot_open(lua_State *L){
+	const char *path = luaL_checkstring(L,1);
+	size_t size = 0;
+	const void *data = map_file(path,&size);
+	if(data == NULL){return 0;}
+	struct snapshot_ud *ud = lua_newuserdata(L,sizeof(*ud));
+	ud->data = data;
+	ud->size = size;
+	static luaL_Reg f[] = {
+		{"pixels",lsnapshot_pixels},
+		{"close",lsnapshot_close},
+		{"__gc",lsnapshot_close},
+		{NULL,NULL}
+	};
+	if(luaL_newmetatable(L,SNAPSHOT_NAME)){
+		luaL_newlib(L,f);
+		lua_setfield(L,-2,"__index");
+	}
+	lua_setmetatable(L,-2);
+	return 1;
+}
+
+static int
+lsprite_release(lua_State *L){
+	struct sprite_atlas **ud = lua_touserdata(L,1);
+	if(*ud){sprite_release(*ud);}
+	*ud = NULL;
+	return 0;
+}
+
+static void
+push_rect(lua_State *L, const struct dfont_rect *rect){
+	lua_pushinteger(L,rect->x);
+	lua_pushinteger(L,rect->y);
+	lua_pushinteger(L,rect->w);
+	lua_pushinteger(L,rect->h);
+	lua_pushinteger(L,rect->page);
+}
+
+static int
+lsprite_lookup(lua_State *L){
+	struct sprite_atlas **ud = luaL_checkudata(L,1,SPRITE_NAME);
+	uint64_t key = luaL_checkinteger(L,2);
+	struct dfont_rect rect;
+	if(!sprite_lookup(*ud,key,&rect)){return 0;}
+	push_rect(L,&rect);
+	return 5;
+}
+
+/*
+ * sprite:insert(key, w, h, rgba [, pitch])
+ * rgba is a string or lightuserdata of w*h RGBA pixels, pitch bytes a row (w*4 by default).
+ * return x,y,w,h,page to draw and {x,y,w,h,page,pixels} to upload with the padding, nothing when there is no room
+ */
+static int
+lsprite_insert(lua_State *L){
+	struct sprite_atlas **ud = luaL_checkudata(L,1,SPRITE_NAME);
+	uint64_t key = luaL_checkinteger(L,2);
+	int w = luaL_checkinteger(L,3);
+	int h = luaL_checkinteger(L,4);
+	int pitch = luaL_optinteger(L,6,w*4);
+	luaL_argcheck(L,w > 0 && h > 0 && pitch >= w*4,5,"w*h RGBA pixels expected");
+	const void *rgba;
+	if(lua_type(L,5) == LUA_TLIGHTUSERDATA){
+		rgba = lua_touserdata(L,5);
+	} else {
+		size_t sz;
+		rgba = luaL_checklstring(L,5,&sz);
+		luaL_argcheck(L,sz >= (size_t)pitch*(h-1) + w*4,5,"w*h RGBA pixels expected");
+	}
+	struct dfont_rect rect,upload;
+	if(!sprite_insert(*ud,key,w,h,&rect,&upload)){return 0;}
+	push_rect(L,&rect);
+	lua_createtable(L,6,0);
+	lua_pushinteger(L,upload.x);
+	lua_rawseti(L,-2,1);
+	lua_pushinteger(L,upload.y);
+	lua_rawseti(L,-2,2);
+	lua_pushinteger(L,upload.w);
+	lua_rawseti(L,-2,3);
+	lua_pushinteger(L,upload.h);
+	lua_rawseti(L,-2,4);
+	lua_pushinteger(L,upload.page);
+	lua_rawseti(L,-2,5);
+	luaL_Buffer b;
+	// what sprite_pad writes, the padded w*h
+	int pad = sprite_padding(*ud);
+	size_t size = (size_t)(w + 2 * pad) * (h + 2 * pad) * 4;
+	char *buf = luaL_buffinitsize(L,&b,size);
+	sprite_pad(*ud,rgba,pitch,w,h,buf);
+	luaL_pushresultsize(&b,size);
+	lua_rawseti(L,-2,6);
+	return 6;
+}
+
+static int
+lsprite_remove(lua_State *L){
+	struct sprite_atlas **ud = luaL_checkudata(L,1,SPRITE_NAME);
+	sprite_remove(*ud,luaL_checkinteger(L,2));
+	return 0;
+}
+
+/*
+ * sprite:flush()
+ * call once a frame, the sprites not looked up since can be evicted
+ */
+static int
+lsprite_flush(lua_State *L){
+	struct sprite_atlas **ud = luaL_checkudata(L,1,SPRITE_NAME);
+	dfont_flush(sprite_dfont(*ud));
+	return 0;
+}
+
+static int
+lsprite_height_class(lua_State *L){
+	struct sprite_atlas **ud = luaL_checkudata(L,1,SPRITE_NAME);
+	int step = luaL_checkinteger(L,2);
+	int growth = luaL_optinteger(L,3,0);
+	dfont_height_class(sprite_dfont(*ud),step,growth);
+	return 0;
+}
+
+/*
+ * font.sprite_create(w, h [, pages [, padding [, min_size]]])
+ * an RGBA sprite atlas of w*h pages, padding is 1 pixel by default.
+ * min_size is the smallest side of the sprites, 16 pixels by default : the atlas has room for pages full of them
+ */
+static int
+lsprite_create(lua_State *L){
+	int w = luaL_checkinteger(L,1);
+	int h = luaL_checkinteger(L,2);
+	int pages = luaL_optinteger(L,3,1);
+	int padding = luaL_optinteger(L,4,1);
+	int min_size = luaL_optinteger(L,5,16);
+	luaL_argcheck(L,min_size > 0,5,"invalid size");
+	struct sprite_atlas **ud = lua_newuserdata(L,sizeof(*ud));
+	*ud = sprite_create(w,h,pages,padding,min_size);
+	if(*ud == NULL){return luaL_error(L,"can't create a %dx%d sprite atlas",w,h);}
+	static luaL_Reg f[] = {
+		{"lookup",lsprite_lookup},
+		{"insert",lsprite_insert},
+		{"remove",lsprite_remove},
+		{"flush",lsprite_flush},
+		{"height_class",lsprite_height_class},
+		{"__gc",lsprite_release},
+		{NULL,NULL}
+	};
+	if(luaL_newmetatable(L,SPRITE_NAME)){
+		luaL_newlib(L,f);
+		lua_setfield(L,-2,"__index");
+	}
+	lua_setmetatable(L,-2);
+	return 1;
+}
+
+static int
+lpool_release(lua_State *L){
+	struct glyph_pool **ud = lua_touserdata(L,1);
+	if(*ud){glyph_pool_release(*ud);}
+	*ud = NULL;
+	return 0;
+}
+
+/*
+ * pool:font(size [, name [, spread]])
+ * return the id of the font for dfont:lookup_async, every worker creates its own font_context of it.
+ * with a spread its glyphs are distance fields, as the ones of dfont:lookup_sdf
+ */
+static int
+lpool_font(lua_State *L){
+	struct glyph_pool **ud = luaL_checkudata(L,1,POOL_NAME);
+	int size = luaL_checkinteger(L,2);
+	const char *name = luaL_optstring(L,3,NULL);
+	int spread = luaL_optinteger(L,4,0);
+	luaL_argcheck(L,*ud != NULL,1,"released glyph pool");
+	luaL_argcheck(L,spread >= 0 && spread <= SDF_MAX_SPREAD,4,"invalid spread");
+	int id = glyph_pool_font(*ud,name,size,spread);
+	if(id < 0){return luaL_error(L,"can't create font %s",name ? name : "(default)");}
+	lua_pushinteger(L,id);
+	return 1;
+}
+
+static int
+lpool_pending(lua_State *L){
+	struct glyph_pool **ud = luaL_checkudata(L,1,POOL_NAME);
+	lua_pushinteger(L,*ud ? glyph_pool_pending(*ud) : 0);
+	return 1;
+}
+
+/*
+ * font.glyph_pool([threads])
+ * worker threads rasterizing the glyphs missed by dfont:lookup_async
+ */
+static int
+lpool_create(lua_State *L){
+	int threads = luaL_optinteger(L,1,2);
+	struct glyph_pool **ud = lua_newuserdata(L,sizeof(*ud));
+	*ud = glyph_pool_create(threads);
+	if(*ud == NULL){return luaL_error(L,"can't start the glyph pool threads");}
+	static luaL_Reg f[] = {
+		{"font",lpool_font},
+		{"pending",lpool_pending},
+		{"release",lpool_release},
+		{"__gc",lpool_release},
+		{NULL,NULL}
+	};
+	if(luaL_newmetatable(L,POOL_NAME)){
+		luaL_newlib(L,f);
+		lua_setfield(L,-2,"__index");
+	}
+	lua_setmetatable(L,-2);
+	return 1;
+}
+
+static int
+ltext_release(lua_State *L){
+	struct text_buffer *b = lua_touserdata(L,1);
+	text_buffer_release(b);
+	return 0;
+}
+
+static int
+ltext_clear(lua_State *L){
+	struct text_buffer *b = luaL_checkudata(L,1,TEXT_NAME);
+	text_buffer_clear(b);
+	return 0;
+}
+
+static int
+ltext_quads(lua_State *L){
+	struct text_buffer *b = luaL_checkudata(L,1,TEXT_NAME);
+	lua_pushinteger(L,b->n);
+	return 1;
+}
+
+/*
+ * buffer:data()
+ * return the vertices as a lightuserdata and their size in bytes, for gl.glBufferData. they move on the next layout
+ */
+static int
+ltext_data(lua_State *L){
+	struct text_buffer *b = luaL_checkudata(L,1,TEXT_NAME);
+	lua_pushlightuserdata(L,b->v);
+	lua_pushinteger(L,b->n * 4 * sizeof(struct text_vertex));
+	return 2;
+}
+
+/*
+ * font.text_buffer(xscale, yscale, uscale, vscale)
+ * the vertices of dfont:layout, {x,y,u,v,r,g,b,a,layer} floats with layer the atlas page of the glyph.
+ * the pixels are scaled by xscale, yscale and the atlas coordinates by uscale, vscale
+ */
+static int
+ltext_create(lua_State *L){
+	float xscale = luaL_checknumber(L,1);
+	float yscale = luaL_checknumber(L,2);
+	float uscale = luaL_checknumber(L,3);
+	float vscale = luaL_checknumber(L,4);
+	struct text_buffer *b = lua_newuserdata(L,sizeof(*b));
+	text_buffer_init(b,xscale,yscale,uscale,vscale);
+	static luaL_Reg f[] = {
+		{"clear",ltext_clear},
+		{"quads",ltext_quads},
+		{"data",ltext_data},
+		{"__gc",ltext_release},
+		{NULL,NULL}
+	};
+	if(luaL_newmetatable(L,TEXT_NAME)){
+		luaL_newlib(L,f);
+		lua_setfield(L,-2,"__index");
+	}
+	lua_setmetatable(L,-2);
+	return 1;
+}
+
+static int
+lrun_release(lua_State *L){
+	struct text_run *r = lua_touserdata(L,1);
+	text_run_release(r);
+	return 0;
+}
+
+static int
+lrun_quads(lua_State *L){
+	struct text_run *r = luaL_checkudata(L,1,RUN_NAME);
+	lua_pushinteger(L,r->b.n);
+	return 1;
+}
+
+/*
+ * run:data()
+ * as buffer:data, the quads of the last dfont:layout_run. they move when it lays them out again
+ */
+static int
+lrun_data(lua_State *L){
+	struct text_run *r = luaL_checkudata(L,1,RUN_NAME);
+	lua_pushlightuserdata(L,r->b.v);
+	lua_pushinteger(L,r->b.n * 4 * sizeof(struct text_vertex));
+	return 2;
+}
+
+/*
+ * font.text_run()
+ * the retained quads of a text, see dfont:layout_run
+ */
+static int
+lrun_create(lua_State *L){
+	struct text_run *r = lua_newuserdata(L,sizeof(*r));
+	text_run_init(r);
+	static luaL_Reg f[] = {
+		{"quads",lrun_quads},
+		{"data",lrun_data},
+		{"__gc",lrun_release},
+		{NULL,NULL}
+	};
+	if(luaL_newmetatable(L,RUN_NAME)){
+		luaL_newlib(L,f);
+		lua_setfield(L,-2,"__index");
+	}
+	lua_setmetatable(L,-2);
+	return 1;
+}
+
 int
 luaopen_font(lua_State *L){
 	static luaL_Reg f[] = {
 		{"dfont_create",ldfont_create},
+		{"dfont_shared",ldfont_shared},
+		{"dfont_attach",ldfont_attach},
 		{"font_create",lfont_create},
+		{"sprite_create",lsprite_create},
+		{"glyph_pool",lpool_create},
+		{"text_buffer",ltext_create},
+		{"text_run",lrun_create},
+		{"snapshot_open",lsnapshot_open},
 		{NULL,NULL}
 	};
 	luaL_newlib(L,f);
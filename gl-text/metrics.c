@@ -0,0 +1,140 @@
+#include "font.h"
+#include <stdlib.h>
+#include <string.h>
+
+// the BMP is 256 pages of 256 chars, a page is allocated when a char of it is first measured.
+// the higher planes are in an open addressing hash
+#define PAGE_BITS 8
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define BMP_PAGE (0x10000 >> PAGE_BITS)
+#define HASH_INIT 64
+
+struct metrics_page {
+	struct glyph_metrics m[PAGE_SIZE];
+	unsigned char known[PAGE_SIZE];
+};
+
+struct metrics_slot {
+	int unicode;	// -1 when empty
+	struct glyph_metrics m;
+};
+
+struct font_metrics {
+	struct metrics_page *page[BMP_PAGE];
+	struct metrics_slot *hash;
+	int hash_size;	// a power of 2
+	int hash_n;
+	struct glyph_metrics invalid;	// a negative unicode is measured each time, it is not a key of the hash
+};
+
+static inline int
+hash_index(int unicode, int size) {
+	return (int)(((unsigned)unicode * 2654435761u) >> 7) & (size - 1);
+}
+
+static struct metrics_slot *
+hash_find(struct font_metrics *fm, int unicode) {
+	if (fm->hash == NULL)
+		return NULL;
+	int mask = fm->hash_size - 1;
+	int i = hash_index(unicode, fm->hash_size);
+	while (fm->hash[i].unicode != -1) {
+		if (fm->hash[i].unicode == unicode)
+			return &fm->hash[i];
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void
+hash_resize(struct font_metrics *fm, int size) {
+	struct metrics_slot *old = fm->hash;
+	int old_size = fm->hash_size;
+	int i;
+	fm->hash = (struct metrics_slot *)malloc(size * sizeof(*fm->hash));
+	fm->hash_size = size;
+	for (i=0;i<size;i++) {
+		fm->hash[i].unicode = -1;
+	}
+	for (i=0;i<old_size;i++) {
+		if (old[i].unicode != -1) {
+			int j = hash_index(old[i].unicode, size);
+			while (fm->hash[j].unicode != -1)
+				j = (j + 1) & (size - 1);
+			fm->hash[j] = old[i];
+		}
+	}
+	free(old);
+}
+
+// an empty slot for unicode not in the hash, it keeps at most half of the slots in use
+static struct metrics_slot *
+hash_insert(struct font_metrics *fm, int unicode) {
+	if ((fm->hash_n + 1) * 2 > fm->hash_size)
+		hash_resize(fm, fm->hash_size ? fm->hash_size * 2 : HASH_INIT);
+	int i = hash_index(unicode, fm->hash_size);
+	while (fm->hash[i].unicode != -1)
+		i = (i + 1) & (fm->hash_size - 1);
+	++fm->hash_n;
+	fm->hash[i].unicode = unicode;
+	return &fm->hash[i];
+}
+
+static struct glyph_metrics *
+lookup(struct font_context *ctx, int unicode) {
+	struct font_metrics *fm = (struct font_metrics *)ctx->metrics;
+	if (fm == NULL) {
+		fm = (struct font_metrics *)calloc(1, sizeof(*fm));
+		ctx->metrics = fm;
+	}
+	if ((unsigned)unicode < 0x10000) {
+		struct metrics_page *p = fm->page[unicode >> PAGE_BITS];
+		if (p == NULL) {
+			p = (struct metrics_page *)calloc(1, sizeof(*p));
+			fm->page[unicode >> PAGE_BITS] = p;
+		}
+		int i = unicode & (PAGE_SIZE - 1);
+		if (!p->known[i]) {
+			font_measure(unicode, ctx, &p->m[i]);
+			p->known[i] = 1;
+		}
+		return &p->m[i];
+	}
+	if (unicode < 0) {
+		font_measure(unicode, ctx, &fm->invalid);
+		return &fm->invalid;
+	}
+	struct metrics_slot *s = hash_find(fm, unicode);
+	if (s == NULL) {
+		s = hash_insert(fm, unicode);
+		font_measure(unicode, ctx, &s->m);
+	}
+	return &s->m;
+}
+
+const struct glyph_metrics *
+font_metrics(int unicode, struct font_context *ctx) {
+	return lookup(ctx, unicode);
+}
+
+void
+font_metrics_prewarm(const int *unicode, int n, struct font_context *ctx) {
+	int i;
+	for (i=0;i<n;i++) {
+		lookup(ctx, unicode[i]);
+	}
+}
+
+void
+font_metrics_release(struct font_context *ctx) {
+	struct font_metrics *fm = (struct font_metrics *)ctx->metrics;
+	if (fm == NULL)
+		return;
+	int i;
+	for (i=0;i<BMP_PAGE;i++) {
+		free(fm->page[i]);
+	}
+	free(fm->hash);
+	free(fm);
+	ctx->metrics = NULL;
+}
@@ -0,0 +1,123 @@
+#include "font.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+
+static double
+now() {
+	LARGE_INTEGER f, t;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1e9 / f.QuadPart;
+}
+#else
+#include <time.h>
+
+static double
+now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+#define ROUND_COUNT 5
+#define MAX_CELL 0x10000
+#define ATLAS_PITCH 1024
+
+#define RENDER 0	// font_render
+#define SIZE_GLYPH 1	// font_size then font_glyph
+#define DRAW 2	// font_size then font_draw into the rows of an atlas
+
+static unsigned char cell[MAX_CELL];
+static unsigned char atlas[ATLAS_PITCH * 256];
+
+// the best of ROUND_COUNT rounds over n codepoints from first, in ns/glyph
+static double
+run(struct font_context *ctx, int first, int n, int mode) {
+	double best = 0;
+	int r, i;
+	for (r=0;r<ROUND_COUNT;r++) {
+		double t = now();
+		for (i=0;i<n;i++) {
+			switch (mode) {
+			case RENDER:
+				font_render(first + i, ctx, cell, MAX_CELL);
+				break;
+			case SIZE_GLYPH:
+				font_size(NULL, first + i, ctx);
+				font_glyph(NULL, first + i, cell, ctx);
+				break;
+			case DRAW:
+				font_size(NULL, first + i, ctx);
+				font_draw(first + i, ctx, atlas + (i * ctx->w) % (ATLAS_PITCH - ctx->w), ATLAS_PITCH);
+				break;
+			}
+		}
+		t = (now() - t) / n;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+// the best of ROUND_COUNT rounds of font_measure, the system call, or font_size, cached after the first round
+static double
+measure(struct font_context *ctx, int first, int n, int cached) {
+	struct glyph_metrics m;
+	double best = 0;
+	int r, i;
+	for (r=0;r<ROUND_COUNT;r++) {
+		double t = now();
+		for (i=0;i<n;i++) {
+			if (cached)
+				font_size(NULL, first + i, ctx);
+			else
+				font_measure(first + i, ctx, &m);
+		}
+		t = (now() - t) / n;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int
+main(int argc, char *argv[]) {
+	int size = argc > 1 ? atoi(argv[1]) : 24;
+	// a face for GDI, the font file for stb_truetype
+	const char *name = argc > 2 ? argv[2] : NULL;
+	struct font_context ctx;
+	if (!font_create(name, size, &ctx)) {
+		fprintf(stderr, "can't create font %s\n", name ? name : "(default)");
+		return 1;
+	}
+	if (ctx.h * ctx.h * 2 > MAX_CELL || ctx.h > 256) {
+		fprintf(stderr, "size %d is too large\n", size);
+		return 1;
+	}
+	static const struct {
+		const char *name;
+		int first;
+		int n;
+	} set[] = {
+		{ "ascii", 0x21, 94 },
+		{ "latin", 0xc0, 192 },
+		{ "cjk", 0x4e00, 3500 },
+	};
+	int i;
+	for (i=0;i<(int)(sizeof(set)/sizeof(set[0]));i++) {
+		double single = run(&ctx, set[i].first, set[i].n, RENDER);
+		double twice = run(&ctx, set[i].first, set[i].n, SIZE_GLYPH);
+		double draw = run(&ctx, set[i].first, set[i].n, DRAW);
+		printf("%-6s %dpx  font_render %8.1f ns/glyph  font_size+font_glyph %8.1f ns/glyph  font_size+font_draw %8.1f ns/glyph\n", set[i].name, size, single, twice, draw);
+		double system = measure(&ctx, set[i].first, set[i].n, 0);
+		double cached = measure(&ctx, set[i].first, set[i].n, 1);
+		printf("%-6s %dpx  font_measure %7.1f ns/glyph  font_size (cached) %8.1f ns/glyph\n", set[i].name, size, system, cached);
+	}
+	font_release(&ctx);
+	return 0;
+}
@@ -0,0 +1,161 @@
+#include "dfont.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+
+static double
+now() {
+	LARGE_INTEGER f, t;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1e9 / f.QuadPart;
+}
+#else
+#include <time.h>
+
+static double
+now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+#define MAX_MOVES 0x10000
+
+struct op {
+	int op;
+	int args[DFONT_TRACE_ARGS];
+};
+
+static int nargs[] = { 0, 3, 5, 3, 1, 1, 2, 2, 4, 3 };
+
+static int
+read_varint(FILE *f, int *v) {
+	uint32_t u = 0;
+	int shift = 0;
+	int c;
+	do {
+		c = fgetc(f);
+		if (c == EOF || shift > 28)
+			return 0;
+		u |= (uint32_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	*v = (int)(u >> 1) ^ -(int)(u & 1);
+	return 1;
+}
+
+// the whole trace is decoded first, so only the dfont calls are timed
+static struct op *
+load(FILE *f, int *n) {
+	int cap = 0x10000;
+	struct op *ops = (struct op *)malloc(cap * sizeof(*ops));
+	int c;
+	*n = 0;
+	while ((c = fgetc(f)) != EOF) {
+		if (c < 1 || c >= (int)(sizeof(nargs) / sizeof(nargs[0]))) {
+			fprintf(stderr, "bad op %d at record %d\n", c, *n);
+			break;
+		}
+		if (*n == cap) {
+			cap *= 2;
+			ops = (struct op *)realloc(ops, cap * sizeof(*ops));
+		}
+		struct op *o = &ops[*n];
+		int i;
+		o->op = c;
+		for (i=0;i<nargs[c];i++) {
+			if (!read_varint(f, &o->args[i])) {
+				fprintf(stderr, "truncated record %d\n", *n);
+				return ops;
+			}
+		}
+		++*n;
+	}
+	return ops;
+}
+
+int
+main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace [pages]\n", argv[0]);
+		return 1;
+	}
+	FILE *f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "can't open %s\n", argv[1]);
+		return 1;
+	}
+	int32_t header[4];
+	if (fread(header, sizeof(header), 1, f) != 1 || header[0] != DFONT_TRACE_MAGIC) {
+		fprintf(stderr, "%s is not a dfont trace\n", argv[1]);
+		return 1;
+	}
+	int n;
+	struct op *ops = load(f, &n);
+	fclose(f);
+
+	// the page count can be changed to see how the same traffic does with more room
+	int pages = argc > 2 ? atoi(argv[2]) : header[3];
+	struct dfont *df = dfont_create_pages(header[1], header[2], pages);
+	static struct dfont_move moves[MAX_MOVES];
+	long lookups = 0, misses = 0, inserts = 0, failed = 0;
+	int i;
+	double t = now();
+	for (i=0;i<n;i++) {
+		const int *a = ops[i].args;
+		switch (ops[i].op) {
+		case DFONT_TRACE_LOOKUP:
+			++lookups;
+			if (dfont_lookup(df, a[0], a[1], a[2]) == NULL)
+				++misses;
+			break;
+		case DFONT_TRACE_INSERT: {
+			// the char may be in already, an insert_miss of a char repeated in a string finds it
+			const struct dfont_rect *rect;
+			struct dfont_miss m;
+			++inserts;
+			if (dfont_lookup_many(df, &a[0], 1, a[1], a[4], &rect, &m) && dfont_insert_miss(df, &m, a[2], a[3]) == NULL)
+				++failed;
+			break;
+		}
+		case DFONT_TRACE_REMOVE:
+			dfont_remove(df, a[0], a[1], a[2]);
+			break;
+		case DFONT_TRACE_ERASE:
+			dfont_erase(df, a[0], a[1], a[2]);
+			break;
+		case DFONT_TRACE_FLUSH:
+			dfont_flush(df);
+			break;
+		case DFONT_TRACE_EVICT_PAGE:
+			dfont_evict_page(df, a[0]);
+			break;
+		case DFONT_TRACE_COMPACT:
+			dfont_compact(df, a[0], moves, a[1] < MAX_MOVES ? a[1] : MAX_MOVES);
+			break;
+		case DFONT_TRACE_HEIGHT_CLASS:
+			dfont_height_class(df, a[0], a[1]);
+			break;
+		case DFONT_TRACE_PRIORITY:
+			dfont_priority(df, a[0], a[1], a[2], a[3]);
+			break;
+		}
+	}
+	t = now() - t;
+	struct dfont_stats st;
+	dfont_stats(df, &st);
+	printf("%d ops in %.3f ms : %.1f ns/op\n", n, t / 1e6, n ? t / n : 0.0);
+	printf("lookups %ld, miss rate %.2f%%\n", lookups, lookups ? misses * 100.0 / lookups : 0.0);
+	printf("inserts %ld, failed %ld\n", inserts, failed);
+	printf("evictions : lru %llu, line %llu, page %llu\n",
+		(unsigned long long)st.evict_lru, (unsigned long long)st.evict_line, (unsigned long long)st.evict_page);
+	printf("%d pages, %d rects, fill %.1f%%\n", st.pages, st.rects, st.total_pixels ? st.pixels * 100.0 / st.total_pixels : 0.0);
+	dfont_release(df);
+	free(ops);
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include "sdf.h"
+#include <math.h>
+
+#define INF 1e20f
+// d is the distance out of the glyph, negative inside. the field maps d in [-spread * CUTOFF, spread * (1 - CUTOFF)]
+// to [255, 0] : the outline is at 255 * (1 - CUTOFF), most of the range is kept outside for outlines and glows
+#define CUTOFF 0.25f
+
+size_t
+sdf_scratch_size(int w, int h, int spread) {
+	int fw = w + 2 * spread;
+	int fh = h + 2 * spread;
+	int len = fw > fh ? fw : fh;
+	// outer and inner grids, then f, z and v of the 1d transform
+	return (2 * (size_t)fw * fh + 2 * len + 1) * sizeof(float) + len * sizeof(int);
+}
+
+// the 1d squared distance transform of Felzenszwalb and Huttenlocher, in place along a row or a column
+static void
+edt1d(float *grid, int offset, int stride, int length, float *f, float *z, int *v) {
+	int q, k = 0;
+	v[0] = 0;
+	z[0] = -INF;
+	z[1] = INF;
+	f[0] = grid[offset];
+	for (q=1;q<length;q++) {
+		f[q] = grid[offset + q * stride];
+		float s;
+		// drop the parabolas hidden by the one of q
+		do {
+			int r = v[k];
+			s = (f[q] - f[r] + (float)q * q - (float)r * r) / (q - r) / 2;
+		} while (s <= z[k] && --k >= 0);
+		++k;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = INF;
+	}
+	for (q=0,k=0;q<length;q++) {
+		while (z[k + 1] < q)
+			++k;
+		int r = v[k];
+		grid[offset + q * stride] = f[r] + (float)(q - r) * (q - r);
+	}
+}
+
+static void
+edt(float *grid, int w, int h, float *f, float *z, int *v) {
+	int x, y;
+	for (x=0;x<w;x++)
+		edt1d(grid, x, w, h, f, z, v);
+	for (y=0;y<h;y++)
+		edt1d(grid, y * w, 1, w, f, z, v);
+}
+
+void
+sdf_build(const uint8_t *src, int w, int h, int spread, uint8_t *dst, void *scratch) {
+	int fw = w + 2 * spread;
+	int fh = h + 2 * spread;
+	int len = fw > fh ? fw : fh;
+	size_t n = (size_t)fw * fh;
+	float *outer = (float *)scratch;
+	float *inner = outer + n;
+	float *f = inner + n;
+	float *z = f + len;
+	int *v = (int *)(z + len + 1);
+	size_t i;
+	int x, y;
+	for (i=0;i<n;i++) {
+		outer[i] = INF;
+		inner[i] = 0;
+	}
+	// the antialiased pixels place the edge inside them, half coverage is on it
+	for (y=0;y<h;y++) {
+		for (x=0;x<w;x++) {
+			float a = src[y * w + x] / 255.0f;
+			if (a == 0)
+				continue;
+			size_t j = (size_t)(y + spread) * fw + x + spread;
+			if (a == 1) {
+				outer[j] = 0;
+				inner[j] = INF;
+			} else {
+				float d = 0.5f - a;
+				outer[j] = d > 0 ? d * d : 0;
+				inner[j] = d < 0 ? d * d : 0;
+			}
+		}
+	}
+	edt(outer, fw, fh, f, z, v);
+	edt(inner, fw, fh, f, z, v);
+	for (i=0;i<n;i++) {
+		float d = sqrtf(outer[i]) - sqrtf(inner[i]);
+		float c = 255.0f - 255.0f * (d / spread + CUTOFF);
+		dst[i] = c < 0 ? 0 : (c > 255 ? 255 : (uint8_t)(c + 0.5f));
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef glyph_sdf_h
+#define glyph_sdf_h
+#include <stddef.h>
+#include <stdint.h>
+
+// a signed distance field of a glyph : rasterized once at a reference size, it is drawn at any size and outline width
+// by a shader thresholding it. the field is spread pixels larger than the glyph on every side,
+// SDF_ON_EDGE on the outline and 255 / spread less each pixel out : it reaches 255 at spread / 4 pixels inside
+// and 0 at 3 * spread / 4 pixels outside, so an outline can be up to 3 * spread / 4 wide and a bold up to spread / 4
+#define SDF_MAX_SPREAD 0x7f
+#define SDF_ON_EDGE 191
+// the dfont edge key of the fields, they never share a rect with the glyph bitmaps of the same font key
+#define SDF_EDGE(spread) (0x80 | (spread))
+
+size_t sdf_scratch_size(int w, int h, int spread);
+// src is the w * h coverage of the glyph, dst (w + 2 * spread) * (h + 2 * spread) bytes, scratch sdf_scratch_size bytes
+void sdf_build(const uint8_t *src, int w, int h, int spread, uint8_t *dst, void *scratch);
+
+#endif
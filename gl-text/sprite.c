@@ -0,0 +1,107 @@
+#include "sprite.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define PIXEL 4
+
+struct sprite_atlas {
+	struct dfont *df;
+	int padding;
+};
+
+struct sprite_atlas *
+sprite_create(int width, int height, int max_page, int padding, int min_size) {
+	struct sprite_atlas *sa = (struct sprite_atlas *)malloc(sizeof(*sa));
+	if (sa == NULL)
+		return NULL;
+	sa->padding = padding < 0 ? 0 : padding;
+	// the padded side of the smallest sprite
+	sa->df = dfont_create_min(width, height, max_page, min_size + 2 * sa->padding);
+	if (sa->df == NULL) {
+		free(sa);
+		return NULL;
+	}
+	return sa;
+}
+
+void
+sprite_release(struct sprite_atlas *sa) {
+	dfont_release(sa->df);
+	free(sa);
+}
+
+struct dfont *
+sprite_dfont(struct sprite_atlas *sa) {
+	return sa->df;
+}
+
+int
+sprite_padding(struct sprite_atlas *sa) {
+	return sa->padding;
+}
+
+// the dfont rects hold the padding, and the height of the padded sprite
+static void
+inner_rect(struct sprite_atlas *sa, const struct dfont_rect *outer, struct dfont_rect *rect) {
+	rect->x = outer->x + sa->padding;
+	rect->y = outer->y + sa->padding;
+	rect->w = outer->w - 2 * sa->padding;
+	rect->h = outer->h - 2 * sa->padding;
+	rect->page = outer->page;
+}
+
+int
+sprite_lookup(struct sprite_atlas *sa, uint64_t key, struct dfont_rect *rect) {
+	const struct dfont_rect *outer = dfont_lookup_key(sa->df, key);
+	if (outer == NULL)
+		return 0;
+	inner_rect(sa, outer, rect);
+	return 1;
+}
+
+int
+sprite_insert(struct sprite_atlas *sa, uint64_t key, int w, int h, struct dfont_rect *rect, struct dfont_rect *upload) {
+	if (w <= 0 || h <= 0)
+		return 0;
+	int ow = w + 2 * sa->padding;
+	int oh = h + 2 * sa->padding;
+	const struct dfont_rect *outer = dfont_lookup_key(sa->df, key);
+	if (outer && (outer->w != ow || outer->h != oh)) {
+		// the sprite has changed size, its old room can't hold it
+		dfont_erase_key(sa->df, key);
+		outer = NULL;
+	}
+	if (outer == NULL)
+		outer = dfont_insert_key(sa->df, key, ow, oh);
+	if (outer == NULL)
+		return 0;
+	*upload = *outer;
+	inner_rect(sa, outer, rect);
+	return 1;
+}
+
+void
+sprite_remove(struct sprite_atlas *sa, uint64_t key) {
+	dfont_remove_key(sa->df, key);
+}
+
+void
+sprite_pad(struct sprite_atlas *sa, const void *src, int pitch, int w, int h, void *dst) {
+	int p = sa->padding;
+	int row = (w + 2 * p) * PIXEL;
+	uint8_t *d = (uint8_t *)dst;
+	int y;
+	for (y=0;y<h+2*p;y++) {
+		// the rows above and below repeat the first and the last one
+		int sy = y < p ? 0 : (y >= h + p ? h - 1 : y - p);
+		const uint8_t *s = (const uint8_t *)src + (size_t)sy * pitch;
+		uint8_t *line = d + (size_t)y * row;
+		int x;
+		memcpy(line + p * PIXEL, s, w * PIXEL);
+		for (x=0;x<p;x++) {
+			memcpy(line + x * PIXEL, s, PIXEL);
+			memcpy(line + (p + w + x) * PIXEL, s + (w - 1) * PIXEL, PIXEL);
+		}
+	}
+}
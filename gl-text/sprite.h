@@ -0,0 +1,26 @@
+#ifndef sprite_atlas_h
+#define sprite_atlas_h
+#include "dfont.h"
+
+// RGBA sprites (avatars, icons, map tiles ...) sharing the pages of a dfont, keyed by any 64 bit key.
+// every sprite has padding pixels around it, filled with its border so the filtering doesn't bleed the neighbours in.
+// the sprites drawn since the last dfont_flush are never evicted, the others go in least recently used order
+struct sprite_atlas;
+
+// min_size is the smallest side of the sprites, the atlas holds its pages full of them. return NULL when out of memory
+struct sprite_atlas * sprite_create(int width, int height, int max_page, int padding, int min_size);
+void sprite_release(struct sprite_atlas *);
+// for dfont_flush, dfont_height_class, dfont_stats ...
+struct dfont * sprite_dfont(struct sprite_atlas *);
+// rect is the sprite to draw, inside the padding. return 0 when it is not in
+int sprite_lookup(struct sprite_atlas *, uint64_t key, struct dfont_rect *rect);
+int sprite_padding(struct sprite_atlas *);
+// place a w*h sprite, upload is the padded rect to fill with sprite_pad. a key in at another size is erased and placed again.
+// return 0 when there is no room
+int sprite_insert(struct sprite_atlas *, uint64_t key, int w, int h, struct dfont_rect *rect, struct dfont_rect *upload);
+void sprite_remove(struct sprite_atlas *, uint64_t key);
+// copy the w*h RGBA pixels of src, pitch bytes a row, to dst with the border repeated in the padding.
+// dst is (w + 2 * padding) * (h + 2 * padding) * 4 bytes
+void sprite_pad(struct sprite_atlas *, const void *src, int pitch, int w, int h, void *dst);
+
+#endif
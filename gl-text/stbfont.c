@@ -0,0 +1,145 @@
+#include "font.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "stb_truetype.h"
+
+struct stb_font {
+	stbtt_fontinfo info;
+	unsigned char *data;
+	float scale;
+};
+
+static unsigned char *
+load_file(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	unsigned char *data = NULL;
+	if (sz > 0) {
+		data = (unsigned char *)malloc(sz);
+		if (fread(data, sz, 1, f) != 1) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	return data;
+}
+
+int
+font_create(const char *name, int font_size, struct font_context *ctx) {
+	// there is no system font to fall back on, the file is required
+	if (name == NULL)
+		return 0;
+	unsigned char *data = load_file(name);
+	if (data == NULL)
+		return 0;
+	struct stb_font *f = (struct stb_font *)malloc(sizeof(*f));
+	if (!stbtt_InitFont(&f->info, data, stbtt_GetFontOffsetForIndex(data, 0))) {
+		free(data);
+		free(f);
+		return 0;
+	}
+	f->data = data;
+	// the pixel height is ascent - descent, as the cell height of CreateFontW
+	f->scale = stbtt_ScaleForPixelHeight(&f->info, font_size);
+	int ascent, descent, gap;
+	stbtt_GetFontVMetrics(&f->info, &ascent, &descent, &gap);
+	ctx->font = f;
+	ctx->dc = NULL;
+	ctx->scratch = NULL;
+	ctx->scratch_size = 0;
+	ctx->metrics = NULL;
+	ctx->ascent = (int)(ascent * f->scale + 0.5f);
+	ctx->h = ctx->ascent + (int)(-descent * f->scale + 0.5f) + 1;
+	ctx->w = 0;
+	return 1;
+}
+
+void
+font_release(struct font_context *ctx) {
+	struct stb_font *f = (struct stb_font *)ctx->font;
+	free(f->data);
+	free(f);
+	font_metrics_release(ctx);
+}
+
+static int
+cell_width(struct stb_font *f, int glyph) {
+	int advance, lsb;
+	stbtt_GetGlyphHMetrics(&f->info, glyph, &advance, &lsb);
+	return (int)(advance * f->scale + 0.5f) + 1;
+}
+
+void
+font_measure(int unicode, struct font_context *ctx, struct glyph_metrics *m) {
+	struct stb_font *f = (struct stb_font *)ctx->font;
+	int glyph = stbtt_FindGlyphIndex(&f->info, unicode);
+	int x0, y0, x1, y1;
+	stbtt_GetGlyphBitmapBox(&f->info, glyph, f->scale, f->scale, &x0, &y0, &x1, &y1);
+	m->advance = cell_width(f, glyph) - 1;
+	m->x = x0;
+	m->y = y0;
+	m->w = x1 - x0;
+	m->h = y1 - y0;
+}
+
+void
+font_size(const char *str, int unicode, struct font_context *ctx) {
+	ctx->w = font_metrics(unicode, ctx)->advance + 1;
+}
+
+// clear the cell of ctx->w * ctx->h at dst and draw the glyph on the baseline
+static void
+draw_cell(struct stb_font *f, int glyph, struct font_context *ctx, unsigned char *dst, int pitch) {
+	int i;
+	for (i=0;i<ctx->h;i++) {
+		memset(dst + i * pitch, 0, ctx->w);
+	}
+	int x0, y0, x1, y1;
+	stbtt_GetGlyphBitmapBox(&f->info, glyph, f->scale, f->scale, &x0, &y0, &x1, &y1);
+	// stb draws straight into the cell, clipped to it : an overhang on the left is shifted in
+	int offx = x0 < 0 ? 0 : x0;
+	int offy = ctx->ascent + y0;
+	if (offy < 0)
+		offy = 0;
+	int w = x1 - x0;
+	int h = y1 - y0;
+	if (offx + w > ctx->w)
+		w = ctx->w - offx;
+	if (offy + h > ctx->h)
+		h = ctx->h - offy;
+	if (w > 0 && h > 0)
+		stbtt_MakeGlyphBitmap(&f->info, dst + offy * pitch + offx, w, h, pitch, f->scale, f->scale, glyph);
+}
+
+int
+font_render(int unicode, struct font_context *ctx, void *buffer, int size) {
+	struct stb_font *f = (struct stb_font *)ctx->font;
+	int glyph = stbtt_FindGlyphIndex(&f->info, unicode);
+	ctx->w = cell_width(f, glyph);
+	int cell = ctx->w * ctx->h;
+	if (cell > size)
+		return cell;
+	draw_cell(f, glyph, ctx, (unsigned char *)buffer, ctx->w);
+	return cell;
+}
+
+void
+font_draw(int unicode, struct font_context *ctx, void *dst, int pitch) {
+	struct stb_font *f = (struct stb_font *)ctx->font;
+	font_size(NULL, unicode, ctx);
+	draw_cell(f, stbtt_FindGlyphIndex(&f->info, unicode), ctx, (unsigned char *)dst, pitch);
+}
+
+void
+font_glyph(const char * str, int unicode, void * buffer, struct font_context *ctx) {
+	font_render(unicode, ctx, buffer, ctx->w * ctx->h);
+}
@@ -11,9 +11,16 @@ local TEXT_TEX_W = 1024
 local TEXT_TEX_H = 1024
 local TEX_XSCALE = 1 / TEXT_TEX_W
 local TEX_YSCALE = 1 / TEXT_TEX_H
+-- the glyphs are distance fields rasterized once at FONT_SIZE, every size is drawn from them
+local SDF_SPREAD = 4
 
-local _font = font.font_create(FONT_SIZE)
 local _dfont = font.dfont_create(1024,1024)	
+local _pool = font.glyph_pool(2)
+local _pool_font = _pool:font(FONT_SIZE,nil,SDF_SPREAD)
+_dfont:height_class(4)
+_dfont:mirror()
+-- the poem is rasterized up front, the first frame draws it whole
+_dfont:prewarm(_pool,"床前明月光疑是地上霜举头望明月低头思故乡",{_pool_font,FONT_SIZE})
 
 local _vs = [[
 #version 300 es
@@ -40,15 +47,22 @@ in vec4 vcolor;
 out vec4 color;
 uniform sampler2D texture0;
 
+// the field is EDGE on the outline of the glyph and falls by 1 / SDF_SPREAD a pixel of FONT_SIZE,
+// OUTLINE widens the shape out of the fill by that much, up to EDGE : 3/4 of SDF_SPREAD pixels
+const float EDGE = 0.75;
+const float OUTLINE = 0.0;
+
 void main(){
-	float c = texture2D(texture0,vtexcoord).w;
-	float alpha = clamp(c,0.0,0.5) * 2.0;
-	color = vec4(vcolor.r * alpha,vcolor.g * alpha,vcolor.b * alpha,vcolor.a);
+	float d = texture2D(texture0,vtexcoord).w;
+	float w = fwidth(d);
+	float alpha = smoothstep(EDGE - w,EDGE + w,d);
+	float shape = smoothstep(EDGE - OUTLINE - w,EDGE - OUTLINE + w,d);
+	color = vec4(vcolor.r * alpha,vcolor.g * alpha,vcolor.b * alpha,vcolor.a * shape);
 }
 ]]
 
 local _program,_dc
-local _vbuffer = {}
+local _text = font.text_buffer(SCREEN_XSCALE,SCREEN_YSCALE,TEX_XSCALE,TEX_YSCALE)
 
 local function _create_shader(t,source)
 	local id = gl.glCreateShader(t)
@@ -93,76 +107,52 @@ local function on_create()
 	gl.glTexParameteri(gl.GL_TEXTURE_2D, gl.GL_TEXTURE_WRAP_T, gl.GL_CLAMP_TO_EDGE )
 	gl.glPixelStorei(gl.GL_UNPACK_ALIGNMENT,1)
 	gl.glTexImage2D(gl.GL_TEXTURE_2D,0,gl.GL_ALPHA,TEXT_TEX_W,TEXT_TEX_H,0,gl.GL_ALPHA,gl.GL_UNSIGNED_BYTE,nil)
-	gl.vertexattr(0,2,gl.GL_FLOAT,gl.GL_FALSE,32,0)
-	gl.vertexattr(1,2,gl.GL_FLOAT,gl.GL_FALSE,32,8)
-	gl.vertexattr(2,4,gl.GL_FLOAT,gl.GL_FALSE,32,16)
+	-- the layer at 32 is always 0, the dfont has one page
+	gl.vertexattr(0,2,gl.GL_FLOAT,gl.GL_FALSE,36,0)
+	gl.vertexattr(1,2,gl.GL_FLOAT,gl.GL_FALSE,36,8)
+	gl.vertexattr(2,4,gl.GL_FLOAT,gl.GL_FALSE,36,16)
 end
 
-local function _pack_vertex(vx,vy,tx,ty,color)
-	return {
-		vx * SCREEN_XSCALE, vy * SCREEN_YSCALE,
-		tx * TEX_XSCALE, ty * TEX_YSCALE,
-		(color >> 24) / 255, --r
-		((color & 0x00ff0000) >> 16) / 255, --g
-		((color & 0x0000ff00) >> 8) / 255,--b,
-		color & 0x000000ff / 255, -- a 
-	}
+local function _commit()
+	local data,size = _text:data()
+	gl.glBufferData(gl.GL_ARRAY_BUFFER,data,size,gl.GL_STREAM_DRAW)
+	gl.glDrawElements(gl.GL_TRIANGLES,_text:quads()*6,gl.GL_UNSIGNED_SHORT,0)
+	_text:clear()
 end
 
 
-local function _pack(x,y,size,rect,color)
-	local w = rect.w * size / FONT_SIZE 
-	local h = rect.h * size / FONT_SIZE 
-	local obj = {}
-	obj[1] = _pack_vertex(x,y,rect.x,rect.y,color)
-	obj[2] = _pack_vertex(x+w,y,rect.x + rect.w,rect.y,color)
-	obj[3] = _pack_vertex(x+w,y + h,rect.x + rect.w,rect.y + rect.h,color)
-	obj[4] = _pack_vertex(x,y + h,rect.x,rect.y + rect.h,color)
-	table.move(obj[1],1,8,#_vbuffer + 1,_vbuffer)
-	table.move(obj[2],1,8,#_vbuffer + 1,_vbuffer)
-	table.move(obj[3],1,8,#_vbuffer + 1,_vbuffer)
-	table.move(obj[4],1,8,#_vbuffer + 1,_vbuffer)
-end
-
-local function _draw_char(sx,sy,unicode,size,color)
-	local x,y,w,h = _dfont:lookup(unicode,size,0)
-	if not x then
-		w,h = _font:size(unicode)
-		local data = _font:glyph(unicode)
-		x,y,w,h = _dfont:insert(unicode,size,w,h,0)
-		gl.glTexSubImage2D(gl.GL_TEXTURE_2D,0,x,y,w,h,gl.GL_ALPHA,gl.GL_UNSIGNED_BYTE,data)
+local function _upload()
+	local u = _dfont:flush_uploads()
+	gl.glPixelStorei(gl.GL_UNPACK_ROW_LENGTH,TEXT_TEX_W)
+	for i = 1,#u,6 do
+		gl.glTexSubImage2D(gl.GL_TEXTURE_2D,0,u[i+1],u[i+2],u[i+3],u[i+4],gl.GL_ALPHA,gl.GL_UNSIGNED_BYTE,u[i+5])
 	end
-	local rect = {x = x,y = y,w = w,h = h}
-	_pack(sx,sy,size,rect,color)
-end
-
-local function _commit()
-	local n = #_vbuffer / 32 
-	gl.glBufferData(gl.GL_ARRAY_BUFFER,_vbuffer,gl.GL_STREAM_DRAW)
-	gl.glDrawElements(gl.GL_TRIANGLES,n*6,gl.GL_UNSIGNED_SHORT,0)
-	_vbuffer = {}
+	gl.glPixelStorei(gl.GL_UNPACK_ROW_LENGTH,0)
 end
 
+-- the quads of each label are kept, and laid out again only when a glyph moves in the atlas
+local _runs = {}
 
 local function _label(x,y,str,size,color)
-	local cx,cy = x,y	
-	local maxh = 0
-	for _,code in utf8.codes(str) do
-		local w,h = _font:size(code)
-		if maxh < h then maxh = h end
-		_draw_char(cx,cy,code,size,color)
-		cx = cx + w *size / FONT_SIZE  
+	local run = _runs[str]
+	if not run then
+		run = font.text_run()
+		_runs[str] = run
 	end
-	return y+maxh 
+	-- the chars still rasterized by the pool are skipped until they are in, their room is kept
+	local h = _dfont:layout_run(run,_text,_pool,_pool_font,str,FONT_SIZE,x,y,size / FONT_SIZE,color)
+	return y+h
 end	
 
 local function on_idle()
 	gl.clear(0)
+	_dfont:collect(_pool)
 	local x,y = 100,100
 	y = _label(x,y,"床前明月光",30,0x1364cb00) + 15 
 	y = _label(x,y,"疑是地上霜",40,0xff7f7f00) + 15 
 	y = _label(x,y,"举头望明月",50,0xff7f0000) + 15 
 	y = _label(x,y,"低头思故乡",60,0xff00ff00) + 15 
+	_upload()
 	_commit()
 	gl.SwapBuffer(_dc)
 end
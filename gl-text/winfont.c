@@ -4,17 +4,27 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 
-#if defined(_MSC_VER)
-#	include <malloc.h>
-#	define ARRAY(type, name, size) type* name = (type*)_alloca((size) * sizeof(type))
-#else
-#	define ARRAY(type, name, size) type name[size]
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GRAY_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define GRAY_NEON
 #endif
 
-void
-font_create(int font_size, struct font_context *ctx) {
+int
+font_create(const char *name, int font_size, struct font_context *ctx) {
 	TEXTMETRIC tm;
+	WCHAR face[LF_FACESIZE];
+	if (name) {
+		if (MultiByteToWideChar(CP_UTF8, 0, name, -1, face, LF_FACESIZE) == 0)
+			return 0;
+	}
 	HFONT f = CreateFontW(
 		font_size,0,
 		0, 0, 
@@ -25,8 +35,10 @@ font_create(int font_size, struct font_context *ctx) {
 		CLIP_DEFAULT_PRECIS,
 		ANTIALIASED_QUALITY,
 		DEFAULT_PITCH, 
-		NULL
+		name ? face : NULL
 	);
+	if (f == NULL)
+		return 0;
 
 	HDC dc = CreateCompatibleDC(NULL);
 	SelectObject(dc, f);
@@ -35,70 +47,158 @@ font_create(int font_size, struct font_context *ctx) {
 	GetTextMetrics(dc,&tm);
 	ctx->h=tm.tmHeight + 1;
 	ctx->ascent=tm.tmAscent;
+	// the bitmaps are rows of 4 bytes, most glyphs are narrower than 2 lines
+	ctx->scratch_size = (2 * ctx->h + 3) * ctx->h;
+	ctx->scratch = malloc(ctx->scratch_size);
+	ctx->metrics = NULL;
+	return 1;
 }
 
 void
 font_release(struct font_context *ctx) {
 	DeleteObject((HFONT)ctx->font);
 	DeleteDC((HDC)ctx->dc);
+	free(ctx->scratch);
+	font_metrics_release(ctx);
 }
 
 static MAT2 mat2={{0,1},{0,0},{0,0},{0,1}};
 
-void 
-font_size(const char *str, int unicode, struct font_context *ctx) {
+void
+font_measure(int unicode, struct font_context *ctx, struct glyph_metrics *m) {
 	GLYPHMETRICS gm;
+	memset(&gm,0,sizeof(gm));
 
 	GetGlyphOutlineW(
 		(HDC)ctx->dc,
 		unicode,
-		GGO_GRAY8_BITMAP,
+		GGO_METRICS,
 		&gm,
 		0,
 		NULL,
 		&mat2
 	);
-	
-	ctx->w = gm.gmCellIncX + 1;
+
+	m->advance = gm.gmCellIncX;
+	m->x = gm.gmptGlyphOrigin.x;
+	m->y = -gm.gmptGlyphOrigin.y;
+	m->w = gm.gmBlackBoxX;
+	m->h = gm.gmBlackBoxY;
 }
 
 void 
-font_glyph(const char * str, int unicode, void * buffer, struct font_context *ctx) {
-	GLYPHMETRICS gm;
-	memset(&gm,0,sizeof(gm));
+font_size(const char *str, int unicode, struct font_context *ctx) {
+	ctx->w = font_metrics(unicode, ctx)->advance + 1;
+}
 
-	ARRAY(uint8_t, tmp, ctx->w * ctx->h);
-	memset(tmp,0, ctx->w * ctx->h);
+// the gray bitmap in ctx->scratch, it grows when the glyph doesn't fit. return its size or GDI_ERROR
+static DWORD
+outline(int unicode, struct font_context *ctx, GLYPHMETRICS *gm) {
+	HDC dc = (HDC)ctx->dc;
+	DWORD n = GetGlyphOutlineW(dc, unicode, GGO_GRAY8_BITMAP, gm, ctx->scratch_size, ctx->scratch, &mat2);
+	if (n != GDI_ERROR)
+		return n;
+	n = GetGlyphOutlineW(dc, unicode, GGO_GRAY8_BITMAP, gm, 0, NULL, &mat2);
+	if (n == GDI_ERROR || n <= (DWORD)ctx->scratch_size)
+		return GDI_ERROR;
+	free(ctx->scratch);
+	ctx->scratch_size = n;
+	ctx->scratch = malloc(n);
+	return GetGlyphOutlineW(dc, unicode, GGO_GRAY8_BITMAP, gm, ctx->scratch_size, ctx->scratch, &mat2);
+}
 
-	GetGlyphOutlineW(
-		(HDC)ctx->dc,
-		unicode,
-		GGO_GRAY8_BITMAP,
-		&gm,
-		ctx->w * ctx->h,
-		tmp,
-		&mat2
-	);
+// the GGO_GRAY8_BITMAP levels are 0..64, convert n of them to 0..255 as src * 255 / 64
+static void
+gray_row(uint8_t *dst, const uint8_t *src, int n) {
+	int i = 0;
+#if defined(__AVX2__)
+	// unpack and pack work on each 128 bit lane, so the bytes come back in order
+	const __m256i zero32 = _mm256_setzero_si256();
+	const __m256i k32 = _mm256_set1_epi16(255);
+	for (;i+32<=n;i+=32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero32), k32), 6);
+		__m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero32), k32), 6);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+#endif
+#if defined(GRAY_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k = _mm_set1_epi16(255);
+	for (;i+16<=n;i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), k), 6);
+		__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), k), 6);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(GRAY_NEON)
+	const uint8x8_t k = vdup_n_u8(255);
+	for (;i+16<=n;i+=16) {
+		uint8x16_t v = vld1q_u8(src + i);
+		uint16x8_t lo = vmull_u8(vget_low_u8(v), k);
+		uint16x8_t hi = vmull_u8(vget_high_u8(v), k);
+		vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 6), vshrn_n_u16(hi, 6)));
+	}
+#endif
+	for (;i<n;i++) {
+		dst[i] = src[i] * 255 / 64;
+	}
+}
 
-	int w = (gm.gmBlackBoxX + 3) & ~3;
-	int h = gm.gmBlackBoxY;
+// clear the cell of ctx->w * ctx->h at dst and draw the bitmap of outline in it, n is the size outline returned
+static void
+draw_cell(struct font_context *ctx, const GLYPHMETRICS *gm, DWORD n, uint8_t *dst, int pitch) {
+	int i;
+	for (i=0;i<ctx->h;i++) {
+		memset(dst + i * pitch, 0, ctx->w);
+	}
+	if (n == 0 || n == GDI_ERROR)
+		return;	// a space
+
+	int w = (gm->gmBlackBoxX + 3) & ~3;
+	int h = gm->gmBlackBoxY;
 
-	uint8_t * buf = (uint8_t *)buffer;
-	int offx = gm.gmptGlyphOrigin.x;
-	int offy = ctx->ascent - gm.gmptGlyphOrigin.y;
+	const uint8_t * tmp = (const uint8_t *)ctx->scratch;
+	int offx = gm->gmptGlyphOrigin.x;
+	int offy = ctx->ascent - gm->gmptGlyphOrigin.y;
 	assert(offx >= 0);
 	assert(offy >= 0);
-	assert(offx + gm.gmBlackBoxX <= ctx->w);
+	assert(offx + gm->gmBlackBoxX <= ctx->w);
 	assert(offy + h <= ctx->h);
 
-	int i,j;
-
 	for (i=0;i<h;i++) {
-		for (j=0;j<gm.gmBlackBoxX;j++) {
-			int src = tmp[i*w+j];
-			buf[(i + offy)*ctx->w + j + offx] = src * 255 / 64;
-		}
+		gray_row(dst + (i + offy) * pitch + offx, tmp + i * w, gm->gmBlackBoxX);
 	}
 }
 
+int
+font_render(int unicode, struct font_context *ctx, void *buffer, int size) {
+	GLYPHMETRICS gm;
+	memset(&gm,0,sizeof(gm));
+	DWORD n = outline(unicode, ctx, &gm);
+	if (n == GDI_ERROR) {
+		font_size(NULL, unicode, ctx);
+	} else {
+		ctx->w = gm.gmCellIncX + 1;
+	}
+	int cell = ctx->w * ctx->h;
+	if (cell > size)
+		return cell;
+	draw_cell(ctx, &gm, n, (uint8_t *)buffer, ctx->w);
+	return cell;
+}
+
+void
+font_draw(int unicode, struct font_context *ctx, void *dst, int pitch) {
+	GLYPHMETRICS gm;
+	memset(&gm,0,sizeof(gm));
+	DWORD n = outline(unicode, ctx, &gm);
+	// the cell of font_size, the caller has made room for it
+	font_size(NULL, unicode, ctx);
+	draw_cell(ctx, &gm, n, (uint8_t *)dst, pitch);
+}
 
+void 
+font_glyph(const char * str, int unicode, void * buffer, struct font_context *ctx) {
+	font_render(unicode, ctx, buffer, ctx->w * ctx->h);
+}
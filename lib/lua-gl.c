@@ -78,6 +78,15 @@ lglLinkProgram(lua_State *L){
 static int
 lglBufferData(lua_State *L){
     GLenum type = luaL_checkinteger(L,1);
+    if(lua_type(L,2) == LUA_TLIGHTUSERDATA){
+        // a native buffer and its size in bytes
+        const void *data = lua_touserdata(L,2);
+        size_t size = luaL_checkinteger(L,3);
+        GLenum opt = luaL_checkinteger(L,4);
+        glBufferData(type,size,data,opt);
+        CHECK_GL_ERROR(L)
+        return 0;
+    }
     luaL_checktype(L,2,LUA_TTABLE);
     size_t len = lua_rawlen(L,2);
     GLenum opt = luaL_checkinteger(L,3);
@@ -373,12 +382,36 @@ lTexSubImage2D(lua_State *L){
 	GLint h = luaL_checkinteger(L,6);
 	GLenum fmt = luaL_checkinteger(L,7);
 	GLenum type = luaL_checkinteger(L,8);
-	const char *data = luaL_checkstring(L,9);
+	const char *data = NULL;
+	if(lua_type(L,9) == LUA_TLIGHTUSERDATA){
+		data = lua_touserdata(L,9);
+	} else {
+		data = luaL_checkstring(L,9);
+	}
 	glTexSubImage2D(target,level,x,y,w,h,fmt,type,data);
 	CHECK_GL_ERROR(L)
 	return 0;
 }
 
+/*
+ * gl.glGetTexImage(target, level, fmt, type, size)
+ * return the texture as a string of size bytes
+ */
+static int
+lGetTexImage(lua_State *L){
+	GLenum target = luaL_checkinteger(L,1);
+	GLint level = luaL_checkinteger(L,2);
+	GLenum fmt = luaL_checkinteger(L,3);
+	GLenum type = luaL_checkinteger(L,4);
+	size_t size = luaL_checkinteger(L,5);
+	luaL_Buffer b;
+	char *buf = luaL_buffinitsize(L,&b,size);
+	glGetTexImage(target,level,fmt,type,buf);
+	luaL_pushresultsize(&b,size);
+	CHECK_GL_ERROR(L)
+	return 1;
+}
+
 static int
 lPixelStorei(lua_State *L){
 	GLenum name = luaL_checkinteger(L,1);
@@ -440,6 +473,7 @@ luaopen_gl(lua_State *L){
         {"glUniformMatrix4fv",lglUniformMatrix4fv},
 		{"glTexImage2D",lTexImage2D},
 		{"glTexSubImage2D",lTexSubImage2D},
+		{"glGetTexImage",lGetTexImage},
 		{"glPixelStorei",lPixelStorei},
 		{"glEnable",lEnable},
 		{"glDisable",lDisable},
@@ -478,6 +512,8 @@ luaopen_gl(lua_State *L){
     _set_constant(L,"GL_TEXTURE_WRAP_T",GL_TEXTURE_WRAP_T);
     _set_constant(L,"GL_CLAMP_TO_EDGE",GL_CLAMP_TO_EDGE);
     _set_constant(L,"GL_UNPACK_ALIGNMENT",GL_UNPACK_ALIGNMENT);
+    _set_constant(L,"GL_PACK_ALIGNMENT",GL_PACK_ALIGNMENT);
+    _set_constant(L,"GL_UNPACK_ROW_LENGTH",GL_UNPACK_ROW_LENGTH);
     _set_constant(L,"GL_ALPHA",GL_ALPHA);
     _set_constant(L,"GL_BLEND",GL_BLEND);
     _set_constant(L,"GL_SRC_ALPHA",GL_SRC_ALPHA);